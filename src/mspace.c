@@ -2398,6 +2398,48 @@ void mspace_malloc_stats(mspace msp) {
   }
 }
 
+size_t mspace_usable_size(const void* mem) {
+  if (mem != 0) {
+    mchunkptr p = mem2chunk(mem);
+    if (cinuse(p))
+      return chunksize(p) - overhead_for(p);
+  }
+  return 0;
+}
+
+void mspace_free_stats(mspace msp, size_t* total, size_t* largest,
+                       size_t* n_blocks) {
+  mstate m = (mstate)msp;
+  *total = *largest = *n_blocks = 0;
+  if (!ok_magic(m)) {
+    USAGE_ERROR_ACTION(m,m);
+    return;
+  }
+  if (!PREACTION(m)) {
+    if (is_initialized(m)) {
+      msegmentptr s = &m->seg;
+      *total = *largest = m->topsize;
+      *n_blocks = 1; /* top always free */
+      while (s != 0) {
+        mchunkptr q = align_as_chunk(s->base);
+        while (segment_holds(s, q) &&
+               q != m->top && q->head != FENCEPOST_HEAD) {
+          if (!cinuse(q)) {
+            size_t sz = chunksize(q);
+            *total += sz;
+            if (sz > *largest)
+              *largest = sz;
+            ++*n_blocks;
+          }
+          q = next_chunk(q);
+        }
+        s = s->next;
+      }
+    }
+    POSTACTION(m);
+  }
+}
+
 size_t mspace_footprint(mspace msp) {
   size_t result;
   mstate ms = (mstate)msp;
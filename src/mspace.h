@@ -105,6 +105,20 @@ void* mspace_memalign(mspace msp, size_t alignment, size_t bytes);
 //void** mspace_independent_comalloc(mspace msp, size_t n_elements,
 //                                   size_t sizes[], void* chunks[]);
 
+/*
+  mspace_usable_size(void* p) returns the number of bytes usable in the
+  allocated chunk p, or 0 if p is null or not in use.
+*/
+size_t mspace_usable_size(const void* mem);
+
+/*
+  mspace_free_stats() reports the total free space, the size of the
+  largest free chunk (the most a single allocation can get) and the
+  number of free chunks. It walks every chunk, so it is slow.
+*/
+void mspace_free_stats(mspace msp, size_t* total, size_t* largest,
+                       size_t* n_blocks);
+
 /*
   mspace_footprint() returns the number of bytes obtained from the
   system for this space.
@@ -99,6 +99,8 @@ struct qxl_ring_header {
 
 #pragma pack(pop)
 typedef struct surface_cache_t surface_cache_t;
+typedef struct atlas_t atlas_t;
+typedef struct image_cache_t image_cache_t;
 
 typedef struct _qxl_screen_t qxl_screen_t;
 
@@ -112,6 +114,52 @@ typedef struct
     uint64_t	high_bits;
 } qxl_memslot_t;
 
+typedef Bool (* qxl_wait_func_t) (qxl_screen_t *qxl, void *data);
+typedef void (* qxl_refresh_func_t) (qxl_screen_t *qxl, void *data);
+
+/* Adaptive spin-then-sleep state and wait time statistics for
+ * one kind of wait, see qxl_wait()
+ */
+typedef struct
+{
+    int			spin_limit;
+
+    /* For conditions whose state has to be fetched from the host,
+     * which is too expensive to do on every poll. Called once before
+     * each sleep instead, and the wait doesn't spin. NULL otherwise.
+     */
+    qxl_refresh_func_t	refresh;
+
+    unsigned long	n_waits;
+    unsigned long	n_sleeps;
+    uint64_t		total_us;
+    uint64_t		max_us;
+} qxl_waiter_t;
+
+/* The ways of getting command memory back from the device, cheapest
+ * first, see allocnf(). Video memory compaction is not one of them,
+ * but is accounted alongside, see qxl_surface_create().
+ */
+typedef enum
+{
+    QXL_RECLAIM_RELEASES,	/* reap the release ring */
+    QXL_RECLAIM_IMAGE_CACHE,	/* drop unreferenced cached images */
+    QXL_RECLAIM_SURFACE_CACHE,	/* destroy cached surfaces with drawables */
+    QXL_RECLAIM_UPDATE,		/* render surfaces that hold drawables */
+    QXL_RECLAIM_NOTIFY_OOM,	/* ask the device to release everything */
+    QXL_RECLAIM_COMPACT_VRAM,	/* relocate surfaces to make a hole */
+
+    QXL_N_RECLAIM_STAGES
+} qxl_reclaim_stage_t;
+
+typedef struct
+{
+    unsigned long	n_runs;
+    unsigned long	n_successes;	/* runs that released memory */
+    uint64_t		total_us;
+    uint64_t		max_us;
+} qxl_reclaim_stats_t;
+
 typedef struct qxl_surface_t qxl_surface_t;
 
 struct qxl_surface_t
@@ -131,15 +179,37 @@ struct qxl_surface_t
 
     qxl_surface_t *	next;
     qxl_surface_t *	prev;	/* Only used in the 'live'
-				 * chain in the surface cache
+				 * chain and the buckets of the
+				 * surface cache
 				 */
 
     int			in_use;
     int			bpp;		/* bpp of the pixmap */
     int			ref_count;
+    int			n_pending;	/* drawables not released yet */
+
+    /* While in the surface cache */
+    int			bucket;		/* -1 when not cached */
+    qxl_surface_t *	lru_next;
+    qxl_surface_t *	lru_prev;
+
+    /* For a slot in an atlas surface, whose id this has. Drawing is
+     * offset by the slot position, which is 0, 0 for other surfaces.
+     */
+    atlas_t *		atlas;
+    int			atlas_node;
+    int			atlas_x;
+    int			atlas_y;
 
     PixmapPtr		pixmap;
 
+    /* Hash of each line of each CELL_WIDTH pixel cell as it was last
+     * seen on the device, or 0 if unknown. Lets finish_access skip
+     * the parts a fallback didn't change.
+     */
+    uint64_t *		line_hashes;
+    int			n_cells;	/* cells per line */
+
     union
     {
 	qxl_surface_t *copy_src;
@@ -154,6 +224,10 @@ enum {
     OPTION_ENABLE_IMAGE_CACHE = 0,
     OPTION_ENABLE_FALLBACK_CACHE,
     OPTION_ENABLE_SURFACES,
+    OPTION_STATS_INTERVAL,
+    OPTION_DEFER_NOTIFY,
+    OPTION_IMAGE_CACHE_SIZE,
+    OPTION_LAZY_SURFACES,
 #ifdef XSPICE
     OPTION_SPICE_PORT,
     OPTION_SPICE_TLS_PORT,
@@ -193,6 +267,7 @@ struct _qxl_screen_t
     struct qxl_ring *		command_ring;
     struct qxl_ring *		cursor_ring;
     struct qxl_ring *		release_ring;
+    uint64_t			release_chain;	/* next release to collect */
     
     int				num_modes;
     struct QXLMode *		modes;
@@ -237,6 +312,7 @@ struct _qxl_screen_t
     CloseScreenProcPtr		close_screen;
     CreateGCProcPtr		create_gc;
     CopyWindowProcPtr		copy_window;
+    ScreenBlockHandlerProcPtr	block_handler;
     
     int16_t			cur_x;
     int16_t			cur_y;
@@ -256,6 +332,7 @@ struct _qxl_screen_t
     uint8_t			vram_mem_slot;
 
     surface_cache_t *		surface_cache;
+    image_cache_t *		image_cache;
 
     /* Evacuated surfaces are stored here during VT switches */
     void *			vt_surfaces;
@@ -265,6 +342,22 @@ struct _qxl_screen_t
     int				enable_image_cache;
     int				enable_fallback_cache;
     int				enable_surfaces;
+    int				image_cache_size;	/* KB, -1 for default */
+    int				defer_notify;
+    int				lazy_surfaces;
+
+    qxl_waiter_t		io_waiter;	/* async I/O commands */
+    qxl_waiter_t		oom_waiter;	/* releases after an OOM notify */
+
+    qxl_reclaim_stats_t		reclaim_stats[QXL_N_RECLAIM_STAGES];
+
+    /* LazySurfaces: pixmaps created, and those that got a surface */
+    unsigned long		n_lazy_created;
+    unsigned long		n_lazy_realized;
+
+    int				stats_interval;	/* seconds, 0 for none */
+    OsTimerPtr			stats_timer;
+    int				stats_request_seen;	/* see SIGUSR2 */
 
 #ifdef VIRTIO_QXL
     int virtiofd;
@@ -287,6 +380,7 @@ struct _qxl_screen_t
     uint32_t           oom_running;
     uint32_t           num_free_res; /* is having a release ring effective
                                         for Xspice? */
+    int                event_fd;     /* signalled by qxl_send_events */
     /* This is only touched from red worker thread - do not access
      * from Xorg threads. */
     struct guest_primary {
@@ -400,9 +494,17 @@ struct qxl_ring * qxl_ring_create      (struct qxl_ring_header *header,
                                         const char *label);
 void              qxl_ring_push        (struct qxl_ring        *ring,
 					const void             *element);
+void              qxl_ring_push_many   (struct qxl_ring        *ring,
+					const void             *elements,
+					int                     n_elements);
+void              qxl_ring_queue       (struct qxl_ring        *ring,
+					const void             *element);
+void              qxl_ring_flush       (struct qxl_ring        *ring);
+void              qxl_ring_kick        (struct qxl_ring        *ring);
 Bool              qxl_ring_pop         (struct qxl_ring        *ring,
 					void                   *element);
 void              qxl_ring_wait_idle   (struct qxl_ring        *ring);
+void              qxl_ring_dump_stats  (struct qxl_ring        *ring);
 
 
 /*
@@ -421,6 +523,14 @@ void *
 qxl_surface_cache_evacuate_all (surface_cache_t *qxl);
 void
 qxl_surface_cache_replace_all (surface_cache_t *qxl, void *data);
+void
+qxl_surface_cache_drawable_released (surface_cache_t *qxl, uint32_t id);
+int
+qxl_surface_cache_shrink (surface_cache_t *qxl);
+void
+qxl_surface_cache_dump_stats (surface_cache_t *qxl);
+int
+qxl_surface_cache_update_busy (surface_cache_t *qxl, int max_surfaces);
 
 void		    qxl_surface_set_pixmap (qxl_surface_t *surface,
 					    PixmapPtr      pixmap);
@@ -470,7 +580,14 @@ extern DevPrivateKeyRec uxa_pixmap_index;
 extern int uxa_pixmap_index;
 #endif
 
-static inline qxl_surface_t *get_surface (PixmapPtr pixmap)
+/* Stored instead of a surface for pixmaps whose data qxl_create_pixmap
+ * allocated in system memory: LAZY_SURFACE until their first
+ * accelerated use creates a surface, NO_SURFACE if that failed.
+ */
+#define LAZY_SURFACE	((qxl_surface_t *)1)
+#define NO_SURFACE	((qxl_surface_t *)2)
+
+static inline qxl_surface_t *get_surface_private (PixmapPtr pixmap)
 {
 #if HAS_DEVPRIVATEKEYREC
     return dixGetPrivate(&pixmap->devPrivates, &uxa_pixmap_index);
@@ -479,6 +596,29 @@ static inline qxl_surface_t *get_surface (PixmapPtr pixmap)
 #endif
 }
 
+static inline qxl_surface_t *get_surface (PixmapPtr pixmap)
+{
+    qxl_surface_t *surface = get_surface_private (pixmap);
+
+    if (surface == LAZY_SURFACE || surface == NO_SURFACE)
+	return NULL;
+
+    return surface;
+}
+
+static inline Bool pixmap_is_lazy (PixmapPtr pixmap)
+{
+    return get_surface_private (pixmap) == LAZY_SURFACE;
+}
+
+/* Whether the pixmap data is ours to free */
+static inline Bool pixmap_has_own_data (PixmapPtr pixmap)
+{
+    qxl_surface_t *surface = get_surface_private (pixmap);
+
+    return surface == LAZY_SURFACE || surface == NO_SURFACE;
+}
+
 static inline void set_surface (PixmapPtr pixmap, qxl_surface_t *surface)
 {
     dixSetPrivate(&pixmap->devPrivates, &uxa_pixmap_index, surface);
@@ -506,11 +646,48 @@ struct QXLImage *qxl_image_create     (qxl_screen_t           *qxl,
 void              qxl_image_destroy    (qxl_screen_t           *qxl,
 					struct QXLImage       *image);
 void		  qxl_drop_image_cache (qxl_screen_t	       *qxl);
+image_cache_t *	  qxl_image_cache_create (qxl_screen_t	       *qxl,
+					  unsigned long		max_bytes);
+void		  qxl_image_cache_destroy (image_cache_t       *cache);
+int		  qxl_image_cache_evict (image_cache_t	       *cache);
+void		  qxl_image_cache_dump_stats (image_cache_t    *cache);
 
 
 /*
  * Malloc
  */
+typedef enum
+{
+    QXL_SLAB_DRAWABLE,
+    QXL_SLAB_SURFACE_CMD,
+    QXL_SLAB_CURSOR_CMD,
+    QXL_SLAB_IMAGE,
+
+    QXL_N_SLAB_TYPES
+} qxl_slab_type_t;
+
+/*
+ * Allocator telemetry. Allocations are counted by size class: class
+ * 0 holds requests below 32 bytes, class i those from 16 << i up to
+ * 32 << i, and the last class everything larger.
+ */
+#define QXL_MEM_N_SIZE_CLASSES	16
+
+typedef struct
+{
+    unsigned long	n_bytes;	/* size of the space */
+    unsigned long	in_use;
+    unsigned long	high_water;
+    unsigned long	total_free;	/* these three only if walked */
+    unsigned long	largest_free;
+    unsigned long	n_free_blocks;
+    unsigned long	n_allocs;
+    unsigned long	n_frees;
+    unsigned long	n_failures;	/* allocations that found no space */
+    unsigned long	n_retries;	/* retries after collecting garbage */
+    unsigned long	size_classes[QXL_MEM_N_SIZE_CLASSES];
+} qxl_mem_stats_t;
+
 int		  qxl_handle_oom (qxl_screen_t *qxl);
 struct qxl_mem *  qxl_mem_create       (void                   *base,
 					unsigned long           n_bytes);
@@ -521,9 +698,34 @@ void *            qxl_alloc            (struct qxl_mem         *mem,
 void              qxl_free             (struct qxl_mem         *mem,
 					void                   *d);
 void              qxl_mem_free_all     (struct qxl_mem         *mem);
+void		  qxl_mem_get_stats    (struct qxl_mem         *mem,
+					qxl_mem_stats_t        *stats,
+					Bool                    walk);
+void		  qxl_mem_count_retry  (struct qxl_mem         *mem);
+unsigned long	  qxl_mem_usable_size  (struct qxl_mem         *mem,
+					void                   *d);
+Bool		  qxl_mem_is_low       (struct qxl_mem         *mem);
 void *            qxl_allocnf          (qxl_screen_t           *qxl,
 					unsigned long           size);
 int		   qxl_garbage_collect (qxl_screen_t *qxl);
+int		   qxl_garbage_collect_some (qxl_screen_t *qxl,
+					     int           budget);
+void *		  qxl_slab_alloc       (struct qxl_mem         *mem,
+					qxl_slab_type_t         type);
+void		  qxl_slab_free	       (struct qxl_mem         *mem,
+					void                   *d);
+void *		  qxl_slab_allocnf     (qxl_screen_t           *qxl,
+					qxl_slab_type_t         type);
+void		  qxl_wc_memcpy	       (void		       *dest,
+					const void	       *src,
+					size_t			n_bytes);
+void		  qxl_wc_memcpy_unfenced (void		       *dest,
+					const void	       *src,
+					size_t			n_bytes);
+void		  qxl_wc_fence	       (void);
+void		  qxl_wc_read	       (void		       *dest,
+					const void	       *src,
+					size_t			n_bytes);
 
 /*
  * I/O port commands
@@ -533,6 +735,18 @@ void qxl_memslot_add(qxl_screen_t *qxl, uint8_t id);
 void qxl_create_primary(qxl_screen_t *qxl);
 void qxl_notify_oom(qxl_screen_t *qxl);
 
+/*
+ * Waiting for the device
+ */
+uint64_t qxl_get_time_us (void);
+void qxl_reclaim_account (qxl_screen_t *qxl, qxl_reclaim_stage_t stage,
+			  uint64_t start, Bool success);
+void qxl_waiter_init (qxl_waiter_t *waiter);
+void qxl_wait (qxl_screen_t *qxl, qxl_waiter_t *waiter,
+	       qxl_wait_func_t done, void *data);
+Bool qxl_wait_timeout (qxl_screen_t *qxl, qxl_waiter_t *waiter,
+		       qxl_wait_func_t done, void *data, uint64_t max_us);
+
 #ifdef XSPICE
 /* device to spice-server, now xspice to spice-server */
 void ioport_write(qxl_screen_t *qxl, uint32_t io_port, uint32_t val);
@@ -553,27 +767,38 @@ static inline void ioport_write(qxl_screen_t *qxl, int port, int val)
  * Debug
  */
 void qxl_log_command(qxl_screen_t *qxl, QXLCommand *cmd, char *direction);
+void qxl_dump_stats(qxl_screen_t *qxl, Bool walk_heaps);
 
 #ifdef VIRTIO_QXL
-/* Write guest memory on host*/
-static inline void virtioqxl_push_ram(qxl_screen_t *qxl, void *ptr, int len)
+/* Whether [ptr, ptr + len) lies in device memory, so it can be pushed */
+static inline int virtioqxl_push_in_bounds(qxl_screen_t *qxl, const char *caller,
+                                           void *ptr, int len)
 {
-    char *start, *end;
-    struct qxl_ram_area ram_area;
+    char *start = ptr;
+    char *end = start + len;
     int memlen = qxl->virtio_config.ramsize + qxl->virtio_config.vramsize +
         qxl->virtio_config.romsize;
 
-    start = (char *)ptr;
-    end = (char *)ptr + len;
-
     if (start < (char *)qxl->ram ||
         end > ((char *)qxl->ram + memlen)) {
         fprintf(stderr,"%s: Error pushing memory [%p - %p] out of bounds "
-                "[%p - %p]\n", __func__, start, end, qxl->ram,
+                "[%p - %p]\n", caller, start, end, qxl->ram,
                 (char *)qxl->ram + memlen);
-        return;
+        return 0;
     }
 
+    return 1;
+}
+
+/* Write guest memory on host*/
+static inline void virtioqxl_push_ram(qxl_screen_t *qxl, void *ptr, int len)
+{
+    char *start = ptr;
+    struct qxl_ram_area ram_area;
+
+    if (!virtioqxl_push_in_bounds(qxl, __func__, ptr, len))
+        return;
+
     ram_area.offset = start - (char *)qxl->ram;
     ram_area.len = len;
 
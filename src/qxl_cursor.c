@@ -47,7 +47,7 @@ static struct QXLCursorCmd *
 qxl_alloc_cursor_cmd(qxl_screen_t *qxl)
 {
     struct QXLCursorCmd *cmd =
-	qxl_allocnf (qxl, sizeof(struct QXLCursorCmd));
+	qxl_slab_allocnf (qxl, QXL_SLAB_CURSOR_CMD);
 
     cmd->release_info.id = pointer_to_u64 (cmd) | 1;
     
@@ -110,7 +110,7 @@ qxl_load_cursor_argb (ScrnInfoPtr pScrn, CursorPtr pCurs)
     cursor->chunk.prev_chunk = 0;
     cursor->chunk.data_size = size;
 
-    memcpy (cursor->chunk.data, pCurs->bits->argb, size);
+    qxl_wc_memcpy (cursor->chunk.data, pCurs->bits->argb, size);
 
 #if 0
     int i, j;
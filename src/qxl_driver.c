@@ -34,6 +34,7 @@
 #include <errno.h>
 #include <time.h>
 #include <stdlib.h>
+#include <signal.h>
 #include "qxl.h"
 #include "assert.h"
 #include "qxl_option_helpers.h"
@@ -65,11 +66,19 @@ extern void compat_init_scrn(ScrnInfoPtr);
 
 const OptionInfoRec DefaultOptions[] = {
     { OPTION_ENABLE_IMAGE_CACHE,
-        "EnableImageCache",    OPTV_BOOLEAN, { 0 }, TRUE },
+        "EnableImageCache",    OPTV_BOOLEAN, { 0 }, FALSE },
     { OPTION_ENABLE_FALLBACK_CACHE,
-        "EnableFallbackCache", OPTV_BOOLEAN, { 0 }, TRUE },
+        "EnableFallbackCache", OPTV_BOOLEAN, { 0 }, FALSE },
     { OPTION_ENABLE_SURFACES,
         "EnableSurfaces",	   OPTV_BOOLEAN, { 0 }, TRUE },
+    { OPTION_STATS_INTERVAL,
+        "StatsInterval",	   OPTV_INTEGER, { 0 }, FALSE },
+    { OPTION_DEFER_NOTIFY,
+        "DeferNotify",		   OPTV_BOOLEAN, { 0 }, FALSE },
+    { OPTION_IMAGE_CACHE_SIZE,
+        "ImageCacheSize",	   OPTV_INTEGER, { 0 }, FALSE },
+    { OPTION_LAZY_SURFACES,
+        "LazySurfaces",		   OPTV_BOOLEAN, { 0 }, FALSE },
 #ifdef XSPICE
     { OPTION_SPICE_PORT,
         "SpicePort",                OPTV_INTEGER,   {5900}, FALSE },
@@ -127,14 +136,143 @@ qxl_available_options (int chipid, int busid)
     return DefaultOptions;
 }
 
-static void qxl_wait_for_io_command(qxl_screen_t *qxl)
+static void
+qxl_usleep (int useconds)
+{
+    struct timespec t;
+    
+    t.tv_sec = useconds / 1000000;
+    t.tv_nsec = (useconds - (t.tv_sec * 1000000)) * 1000;
+    
+    errno = 0;
+    while (nanosleep (&t, &t) == -1 && errno == EINTR)
+	;
+    
+}
+
+/*
+ * Waiting for the device
+ *
+ * The condition is polled for a while first, since the device usually
+ * completes quickly. After that the waiter sleeps: in Xspice until the
+ * worker thread sends an event, otherwise with an exponential backoff
+ * capped at a millisecond. The number of polls adapts to how long the
+ * previous waits on the same waiter took. qxl_wait_timeout() gives up
+ * after max_us microseconds, if that is not 0.
+ */
+#define MIN_SPINS	16
+#define MAX_SPINS	4096
+#define MAX_SLEEP_US	1000
+
+uint64_t
+qxl_get_time_us (void)
 {
-    struct QXLRam *ram_header = (void *)(
-        (unsigned long)qxl->ram + qxl->rom->ram_header_offset);
+    struct timespec t;
 
-    while (!(ram_header->int_pending & QXL_INTERRUPT_IO_CMD)) {
-        usleep(1);
+    clock_gettime (CLOCK_MONOTONIC, &t);
+
+    return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+void
+qxl_waiter_init (qxl_waiter_t *waiter)
+{
+    memset (waiter, 0, sizeof *waiter);
+
+    waiter->spin_limit = MIN_SPINS;
+}
+
+Bool
+qxl_wait_timeout (qxl_screen_t *qxl, qxl_waiter_t *waiter,
+		  qxl_wait_func_t done, void *data, uint64_t max_us)
+{
+    uint64_t start, elapsed;
+    int n_spins = 0;
+    int sleep_us = 1;
+    Bool slept = FALSE;
+    Bool result = TRUE;
+
+    if (done (qxl, data))
+	return TRUE;
+
+    start = qxl_get_time_us ();
+
+    while (!done (qxl, data))
+    {
+	if (!waiter->refresh && n_spins < waiter->spin_limit)
+	{
+	    n_spins++;
+	    continue;
+	}
+
+	if (max_us && qxl_get_time_us () - start >= max_us)
+	{
+	    result = FALSE;
+	    break;
+	}
+
+	if (waiter->refresh)
+	{
+	    waiter->refresh (qxl, data);
+	    if (done (qxl, data))
+		break;
+	}
+
+#if defined XSPICE
+	qxl_wait_for_events (qxl, 10);
+	slept = TRUE;
+#else
+	qxl_usleep (sleep_us);
+	if (sleep_us < MAX_SLEEP_US)
+	    sleep_us *= 2;
+	slept = TRUE;
+#endif
+    }
+
+    if (slept)
+    {
+	waiter->n_sleeps++;
+	if (waiter->spin_limit > MIN_SPINS)
+	    waiter->spin_limit /= 2;
+    }
+    else if (waiter->spin_limit < MAX_SPINS)
+    {
+	waiter->spin_limit *= 2;
     }
+
+    elapsed = qxl_get_time_us () - start;
+
+    waiter->n_waits++;
+    waiter->total_us += elapsed;
+    if (elapsed > waiter->max_us)
+	waiter->max_us = elapsed;
+
+    return result;
+}
+
+void
+qxl_wait (qxl_screen_t *qxl, qxl_waiter_t *waiter,
+	  qxl_wait_func_t done, void *data)
+{
+    qxl_wait_timeout (qxl, waiter, done, data, 0);
+}
+
+static Bool
+io_command_done (qxl_screen_t *qxl, void *data)
+{
+    struct QXLRam *ram_header = get_ram_header (qxl);
+
+    mem_barrier ();
+
+    return !!(ram_header->int_pending & QXL_INTERRUPT_IO_CMD);
+}
+
+static void qxl_wait_for_io_command(qxl_screen_t *qxl)
+{
+    struct QXLRam *ram_header = get_ram_header(qxl);
+
+    qxl_wait(qxl, &qxl->io_waiter, io_command_done, NULL);
+
     ram_header->int_pending &= ~QXL_INTERRUPT_IO_CMD;
 }
 
@@ -147,6 +285,10 @@ void qxl_update_area(qxl_screen_t *qxl, qxl_surface_t *surface)
     virtioqxl_push_ram(qxl, &ram_header->update_surface, sizeof(int));
 #endif
 
+    /* The device can only render what it has been given */
+    qxl_ring_flush(qxl->command_ring);
+    qxl_ring_kick(qxl->command_ring);
+
 #if !defined XSPICE && !defined VIRTIO_QXL
     if (qxl->pci->revision >= 3) {
         ioport_write(qxl, QXL_IO_UPDATE_AREA_ASYNC, 0);
@@ -201,165 +343,466 @@ void qxl_notify_oom(qxl_screen_t *qxl)
     ioport_write(qxl, QXL_IO_NOTIFY_OOM, 0);
 }
 
+/*
+ * Garbage collection
+ *
+ * The device returns released commands on the release ring as chains
+ * linked through QXLReleaseInfo.next. Collection is incremental: the
+ * chain being worked on is kept in qxl->release_chain, so a call can
+ * stop after its budget and the next one picks up from there. The
+ * chain is advanced before anything is freed, because freeing can
+ * allocate and collect recursively.
+ *
+ * The block handler does most of the collecting, while the server is
+ * idle. The drawing path only collects, a little at a time, when
+ * command memory runs low.
+ */
+#define POINTER_MASK ((1 << 2) - 1)
+
 int
-qxl_garbage_collect (qxl_screen_t *qxl)
+qxl_garbage_collect_some (qxl_screen_t *qxl, int budget)
 {
-    uint64_t id;
     int i = 0;
 
-    QXLRam *ram = get_ram_header(qxl);;
-
-    while (qxl_ring_pop (qxl->release_ring, &id))
+    while (i != budget)
     {
-	while (id)
+	uint64_t id = qxl->release_chain;
+	union QXLReleaseInfo *info;
+	struct QXLCursorCmd *cmd;
+	struct QXLDrawable *drawable;
+	struct QXLSurfaceCmd *surface_cmd;
+	int is_cursor = FALSE;
+	int is_surface = FALSE;
+	int is_drawable = FALSE;
+
+	if (!id)
 	{
-	    /* We assume that there the two low bits of a pointer are
-	     * available. If the low one is set, then the command in
-	     * question is a cursor command
-	     */
-#define POINTER_MASK ((1 << 2) - 1)
-	    
-	    union QXLReleaseInfo *info = u64_to_pointer (id & ~POINTER_MASK);
-	    struct QXLCursorCmd *cmd = (struct QXLCursorCmd *)info;
-	    struct QXLDrawable *drawable = (struct QXLDrawable *)info;
-	    struct QXLSurfaceCmd *surface_cmd = (struct QXLSurfaceCmd *)info;
-	    int is_cursor = FALSE;
-	    int is_surface = FALSE;
-	    int is_drawable = FALSE;
-
-	    if ((id & POINTER_MASK) == 1)
-		is_cursor = TRUE;
-	    else if ((id & POINTER_MASK) == 2)
-		is_surface = TRUE;
-	    else
-		is_drawable = TRUE;
+	    if (!qxl_ring_pop (qxl->release_ring, &id))
+		break;
 
-	    if (is_cursor && cmd->type == QXL_CURSOR_SET)
-	    {
-		struct QXLCursor *cursor = (void *)virtual_address (
-		    qxl, u64_to_pointer (cmd->u.set.shape), qxl->main_mem_slot);
-		
-		qxl_free (qxl->mem, cursor);
-	    }
-	    else if (is_drawable && drawable->type == QXL_DRAW_COPY)
+	    if (!id)
+		continue;
+	}
+
+	/* We assume that there the two low bits of a pointer are
+	 * available. If the low one is set, then the command in
+	 * question is a cursor command
+	 */
+	info = u64_to_pointer (id & ~POINTER_MASK);
+	cmd = (struct QXLCursorCmd *)info;
+	drawable = (struct QXLDrawable *)info;
+	surface_cmd = (struct QXLSurfaceCmd *)info;
+
+#ifdef VIRTIO_QXL
+	virtioqxl_pull_ram(qxl,&info->next,sizeof(info->next));
+#endif
+	qxl->release_chain = info->next;
+
+	/* The next command is needed right after this one */
+	if (qxl->release_chain)
+	{
+	    __builtin_prefetch (
+		u64_to_pointer (qxl->release_chain & ~POINTER_MASK));
+	}
+
+	if ((id & POINTER_MASK) == 1)
+	    is_cursor = TRUE;
+	else if ((id & POINTER_MASK) == 2)
+	    is_surface = TRUE;
+	else
+	    is_drawable = TRUE;
+
+	if (is_drawable)
+	{
+	    qxl_surface_cache_drawable_released (
+		qxl->surface_cache, drawable->surface_id);
+	}
+
+	if (is_cursor && cmd->type == QXL_CURSOR_SET)
+	{
+	    struct QXLCursor *cursor = (void *)virtual_address (
+		qxl, u64_to_pointer (cmd->u.set.shape), qxl->main_mem_slot);
+	    
+	    qxl_free (qxl->mem, cursor);
+	}
+	else if (is_drawable && drawable->type == QXL_DRAW_COPY)
+	{
+	    struct QXLImage *image = virtual_address (
+		qxl, u64_to_pointer (drawable->u.copy.src_bitmap), qxl->main_mem_slot);
+	    
+	    if (image->descriptor.type == SPICE_IMAGE_TYPE_SURFACE)
 	    {
-		struct QXLImage *image = virtual_address (
-		    qxl, u64_to_pointer (drawable->u.copy.src_bitmap), qxl->main_mem_slot);
-		
-		if (image->descriptor.type == SPICE_IMAGE_TYPE_SURFACE)
-		{
-		    qxl_surface_unref (qxl->surface_cache, image->surface_image.surface_id);
-		    qxl_surface_cache_sanity_check (qxl->surface_cache);
-		    qxl_free (qxl->mem, image);
-		}
-		else
-		{
-		    qxl_image_destroy (qxl, image);
-		}
+		qxl_surface_unref (qxl->surface_cache, image->surface_image.surface_id);
+		qxl_surface_cache_sanity_check (qxl->surface_cache);
+		qxl_slab_free (qxl->mem, image);
 	    }
-	    else if (is_surface && surface_cmd->type == QXL_SURFACE_CMD_DESTROY)
+	    else
 	    {
-		qxl_surface_recycle (qxl->surface_cache, surface_cmd->surface_id);
-		qxl_surface_cache_sanity_check (qxl->surface_cache);
+		qxl_image_destroy (qxl, image);
 	    }
-	    
-#ifdef VIRTIO_QXL
-		virtioqxl_pull_ram(qxl,&info->next,sizeof(info->next));
-		id = info->next;
-#else
-		id = info->next;
-#endif
-	    
-	    qxl_free (qxl->mem, info);
-
-	    ++i;
 	}
+	else if (is_surface && surface_cmd->type == QXL_SURFACE_CMD_DESTROY)
+	{
+	    qxl_surface_recycle (qxl->surface_cache, surface_cmd->surface_id);
+	    qxl_surface_cache_sanity_check (qxl->surface_cache);
+	}
+	
+	/* Drawables, surface commands and cursor commands all
+	 * come from slabs
+	 */
+	qxl_slab_free (qxl->mem, info);
+
+	++i;
     }
     
     return i;
 }
 
-static void
-qxl_usleep (int useconds)
+int
+qxl_garbage_collect (qxl_screen_t *qxl)
 {
-    struct timespec t;
-    
-    t.tv_sec = useconds / 1000000;
-    t.tv_nsec = (useconds - (t.tv_sec * 1000000)) * 1000;
-    
-    errno = 0;
-    while (nanosleep (&t, &t) == -1 && errno == EINTR)
-	;
-    
+    return qxl_garbage_collect_some (qxl, -1);
 }
 
+static Bool
+reap_releases (qxl_screen_t *qxl, void *data)
+{
+    int *n_released = data;
+
+    *n_released += qxl_garbage_collect (qxl);
+
+    return *n_released > 0;
+}
+
+/* The device normally releases within a few hundred microseconds of
+ * an OOM notification, so only wait for as long as that plausibly
+ * takes rather than sleeping a fixed amount.
+ */
+#define OOM_WAIT_US	10000
+
 int
 qxl_handle_oom (qxl_screen_t *qxl)
 {
+    int n_released = 0;
+
+    /* Queued commands hold memory that the device can't release
+     * until it has seen them
+     */
+    qxl_ring_flush (qxl->command_ring);
+    qxl_ring_kick (qxl->command_ring);
+
     qxl_notify_oom(qxl);
 
-#if 0
-    ErrorF (".");
-    qxl_usleep (10000);
-#endif
+    qxl_wait_timeout (qxl, &qxl->oom_waiter,
+		      reap_releases, &n_released, OOM_WAIT_US);
+
+    return n_released;
+}
+
+/* Commands released per allocation when memory is low, and per
+ * block handler call
+ */
+#define GC_ALLOC_BUDGET		32
+#define GC_BLOCK_BUDGET		1024
 
-    if (!(qxl_garbage_collect (qxl)))
-	qxl_usleep (10000);
+/* Surfaces whose drawables are rendered in one reclaim step */
+#define MAX_UPDATED_SURFACES	4
+
+/* Records a run of a reclaim stage that began at @start */
+void
+qxl_reclaim_account (qxl_screen_t *qxl, qxl_reclaim_stage_t stage,
+		     uint64_t start, Bool success)
+{
+    qxl_reclaim_stats_t *stats = &qxl->reclaim_stats[stage];
+    uint64_t elapsed = qxl_get_time_us () - start;
 
-    return qxl_garbage_collect (qxl);
+    stats->n_runs++;
+    if (success)
+	stats->n_successes++;
+    stats->total_us += elapsed;
+    if (elapsed > stats->max_us)
+	stats->max_us = elapsed;
 }
 
-void *
-qxl_allocnf (qxl_screen_t *qxl, unsigned long size)
+/* Runs one reclaim stage and returns whether it got memory back */
+static Bool
+reclaim (qxl_screen_t *qxl, qxl_reclaim_stage_t stage)
+{
+    uint64_t start = qxl_get_time_us ();
+    int n = 0;
+
+    switch (stage)
+    {
+    case QXL_RECLAIM_RELEASES:
+	n = qxl_garbage_collect (qxl);
+	break;
+
+    case QXL_RECLAIM_IMAGE_CACHE:
+	n = qxl_image_cache_evict (qxl->image_cache);
+	break;
+
+    case QXL_RECLAIM_SURFACE_CACHE:
+	/* Destroying a surface makes the device drop the drawables
+	 * it still holds for it
+	 */
+	if (qxl_surface_cache_shrink (qxl->surface_cache))
+	{
+	    qxl_ring_flush (qxl->command_ring);
+	    qxl_ring_kick (qxl->command_ring);
+
+	    n = qxl_garbage_collect (qxl);
+	}
+	break;
+
+    case QXL_RECLAIM_UPDATE:
+	if (qxl_surface_cache_update_busy (qxl->surface_cache,
+					   MAX_UPDATED_SURFACES))
+	{
+	    n = qxl_garbage_collect (qxl);
+	}
+	break;
+
+    case QXL_RECLAIM_NOTIFY_OOM:
+	n = qxl_handle_oom (qxl);
+	break;
+
+    default:
+	break;
+    }
+
+    qxl_reclaim_account (qxl, stage, start, n > 0);
+
+    return n > 0;
+}
+
+/* Allocates from a slab if @slab is not negative, and otherwise
+ * @size bytes from the general command memory. When there is no
+ * space, the reclaim stages are tried in order, cheapest first,
+ * retrying the allocation whenever one of them gets memory back.
+ * If none do, the device is still working through commands that
+ * hold memory, and we start over, so this never returns NULL. A
+ * device that releases nothing for STALL_FATAL_US is taken to be
+ * wedged, and the server exits instead of hanging.
+ */
+#define STALL_REPORT_US	1000000
+#define STALL_FATAL_US	(60 * STALL_REPORT_US)
+
+static void *
+allocnf (qxl_screen_t *qxl, int slab, unsigned long size)
 {
     void *result;
-    int n_attempts = 0;
-#if 0
-    static int nth_oom = 1;
-#endif
+    qxl_reclaim_stage_t stage = QXL_RECLAIM_RELEASES;
+    uint64_t start = 0;
+    uint64_t next_report = STALL_REPORT_US;
 
-    qxl_garbage_collect (qxl);
+    if (qxl_mem_is_low (qxl->mem))
+	qxl_garbage_collect_some (qxl, GC_ALLOC_BUDGET);
     
-    while (!(result = qxl_alloc (qxl->mem, size)))
+    while (!(result = (slab >= 0)?
+	     qxl_slab_alloc (qxl->mem, slab) : qxl_alloc (qxl->mem, size)))
     {
-	struct QXLRam *ram_header = (void *)(
-	    (unsigned long)qxl->ram + qxl->rom->ram_header_offset);
-    
-	/* Rather than go out of memory, we simply tell the
-	 * device to dump everything
-	 */
-	ram_header->update_area.top = 0;
-	ram_header->update_area.bottom = qxl->virtual_y;
-	ram_header->update_area.left = 0;
-	ram_header->update_area.right = qxl->virtual_x;
-	ram_header->update_surface = 0;		/* Only primary for now */
+	qxl_mem_count_retry (qxl->mem);
 
-    qxl_update_area(qxl,0);
+	if (!start)
+	    start = qxl_get_time_us ();
 
-#if 0
- 	ErrorF ("eliminated memory (%d)\n", nth_oom++);
-#endif
+	/* A stage that got something back may have more */
+	if (reclaim (qxl, stage))
+	    continue;
+
+	if (++stage <= QXL_RECLAIM_NOTIFY_OOM)
+	    continue;
+
+	stage = QXL_RECLAIM_RELEASES;
 
-	if (!qxl_garbage_collect (qxl))
+	if (qxl_get_time_us () - start >= STALL_FATAL_US)
 	{
-	    if (qxl_handle_oom (qxl))
-	    {
-		n_attempts = 0;
-	    }
-	    else if (++n_attempts == 1000)
-	    {
-		ErrorF ("Out of memory allocating %ld bytes\n", size);
-		qxl_mem_dump_stats (qxl->mem, "Out of mem - stats\n");
-		
-		fprintf (stderr, "Out of memory\n");
-		exit (1);
-	    }
+	    qxl_dump_stats (qxl, TRUE);
+
+	    FatalError ("qxl: the device released no memory for %llu s\n",
+			(unsigned long long)STALL_FATAL_US / 1000000);
+	}
+
+	if (qxl_get_time_us () - start >= next_report)
+	{
+	    if (slab >= 0)
+		ErrorF ("Waited %llu ms for memory for slab %d\n",
+			(unsigned long long)next_report / 1000, slab);
+	    else
+		ErrorF ("Waited %llu ms for %ld bytes of memory\n",
+			(unsigned long long)next_report / 1000, size);
+
+	    if (next_report == STALL_REPORT_US)
+		qxl_dump_stats (qxl, FALSE);
+
+	    next_report *= 2;
 	}
     }
     
     return result;
 }
 
+void *
+qxl_allocnf (qxl_screen_t *qxl, unsigned long size)
+{
+    return allocnf (qxl, -1, size);
+}
+
+void *
+qxl_slab_allocnf (qxl_screen_t *qxl, qxl_slab_type_t type)
+{
+    return allocnf (qxl, type, 0);
+}
+
+/*
+ * Statistics
+ */
+static void
+dump_mem_stats (qxl_screen_t *qxl, struct qxl_mem *mem, const char *name,
+		Bool walk)
+{
+    qxl_mem_stats_t stats;
+    char classes[QXL_MEM_N_SIZE_CLASSES * 12];
+    int fragmentation = 0;
+    int i, n;
+
+    if (!mem)
+	return;
+
+    qxl_mem_get_stats (mem, &stats, walk);
+
+    xf86DrvMsg (qxl->pScrn->scrnIndex, X_INFO,
+		"%s: %lu of %lu KB in use, high water %lu KB\n",
+		name, stats.in_use / 1024, stats.n_bytes / 1024,
+		stats.high_water / 1024);
+
+    if (walk)
+    {
+	/* The share of free space that is unusable for an allocation
+	 * as large as all of it
+	 */
+	if (stats.total_free)
+	    fragmentation = 100 - stats.largest_free * 100 / stats.total_free;
+
+	xf86DrvMsg (qxl->pScrn->scrnIndex, X_INFO,
+		    "%s: %lu KB free in %lu blocks, largest %lu KB, "
+		    "%d%% fragmented\n",
+		    name, stats.total_free / 1024, stats.n_free_blocks,
+		    stats.largest_free / 1024, fragmentation);
+    }
+
+    xf86DrvMsg (qxl->pScrn->scrnIndex, X_INFO,
+		"%s: %lu allocations, %lu frees, %lu failed, %lu retried\n",
+		name, stats.n_allocs, stats.n_frees,
+		stats.n_failures, stats.n_retries);
+
+    /* Class 0 is below 32 bytes, each further class twice the size */
+    classes[0] = '\0';
+    n = 0;
+    for (i = 0; i < QXL_MEM_N_SIZE_CLASSES && n < (int)sizeof (classes); ++i)
+    {
+	n += snprintf (classes + n, sizeof (classes) - n,
+		       " %lu", stats.size_classes[i]);
+    }
+
+    xf86DrvMsg (qxl->pScrn->scrnIndex, X_INFO,
+		"%s: allocations below 32 bytes, then per doubling of size:%s\n",
+		name, classes);
+}
+
+/* Walking the heaps for their free blocks reads device memory, so it
+ * is only done for dumps that are asked for, not periodic ones
+ */
+void
+qxl_dump_stats (qxl_screen_t *qxl, Bool walk_heaps)
+{
+    int i;
+
+    qxl_ring_dump_stats (qxl->command_ring);
+    qxl_ring_dump_stats (qxl->cursor_ring);
+    qxl_ring_dump_stats (qxl->release_ring);
+
+    xf86DrvMsg (qxl->pScrn->scrnIndex, X_INFO,
+		"I/O commands: %lu waits (%lu slept), %llu us, max %llu us\n",
+		qxl->io_waiter.n_waits, qxl->io_waiter.n_sleeps,
+		(unsigned long long)qxl->io_waiter.total_us,
+		(unsigned long long)qxl->io_waiter.max_us);
+
+    qxl_image_cache_dump_stats (qxl->image_cache);
+    qxl_surface_cache_dump_stats (qxl->surface_cache);
+
+    if (qxl->lazy_surfaces)
+    {
+	xf86DrvMsg (qxl->pScrn->scrnIndex, X_INFO,
+		    "Lazy pixmaps: %lu created, %lu got a surface\n",
+		    qxl->n_lazy_created, qxl->n_lazy_realized);
+    }
+
+    for (i = 0; i < QXL_N_RECLAIM_STAGES; ++i)
+    {
+	static const char *names[QXL_N_RECLAIM_STAGES] =
+	{
+	    "releases", "image cache", "surface cache", "update", "OOM notify",
+	    "VRAM compaction"
+	};
+	qxl_reclaim_stats_t *stats = &qxl->reclaim_stats[i];
+
+	if (!stats->n_runs)
+	    continue;
+
+	xf86DrvMsg (qxl->pScrn->scrnIndex, X_INFO,
+		    "Reclaim %s: %lu runs, %lu released memory, "
+		    "%llu us, max %llu us\n",
+		    names[i], stats->n_runs, stats->n_successes,
+		    (unsigned long long)stats->total_us,
+		    (unsigned long long)stats->max_us);
+    }
+
+    dump_mem_stats (qxl, qxl->mem, "Command RAM", walk_heaps);
+    dump_mem_stats (qxl, qxl->surf_mem, "Surface RAM", walk_heaps);
+}
+
+/* Statistics can also be asked for at any time with SIGUSR2. The
+ * signal handler only counts the request; each screen dumps from its
+ * block handler when it sees a new one. Only these dumps, and the one
+ * at exit, include the free block figures of the heaps.
+ */
+static volatile sig_atomic_t stats_requests;
+static OsSigHandlerPtr old_sigusr2_handler;
+static int n_stats_screens;
+
+static void
+qxl_stats_signal_handler (int signo)
+{
+    stats_requests++;
+}
+
+static void
+qxl_stats_signal_init (qxl_screen_t *qxl)
+{
+    qxl->stats_request_seen = stats_requests;
+
+    if (n_stats_screens++ == 0)
+	old_sigusr2_handler = OsSignal (SIGUSR2, qxl_stats_signal_handler);
+}
+
+static void
+qxl_stats_signal_fini (void)
+{
+    if (--n_stats_screens == 0)
+	OsSignal (SIGUSR2, old_sigusr2_handler);
+}
+
+static CARD32
+qxl_stats_timer_callback (OsTimerPtr timer, CARD32 time, pointer data)
+{
+    qxl_screen_t *qxl = data;
+
+    qxl_dump_stats (qxl, FALSE);
+
+    return qxl->stats_interval * 1000;
+}
+
 static Bool
 qxl_blank_screen(ScreenPtr pScreen, int mode)
 {
@@ -711,6 +1154,28 @@ qxl_close_screen(int scrnIndex, ScreenPtr pScreen)
     
     pScreen->CreateScreenResources = qxl->create_screen_resources;
     pScreen->CloseScreen = qxl->close_screen;
+    pScreen->BlockHandler = qxl->block_handler;
+
+    if (qxl->stats_timer)
+    {
+	qxl_dump_stats (qxl, TRUE);
+
+	TimerFree (qxl->stats_timer);
+	qxl->stats_timer = NULL;
+    }
+
+    qxl_stats_signal_fini ();
+
+#ifdef XSPICE
+    if (qxl->event_fd >= 0)
+    {
+	close (qxl->event_fd);
+	qxl->event_fd = -1;
+    }
+#endif
+
+    qxl_image_cache_destroy (qxl->image_cache);
+    qxl->image_cache = NULL;
     
     result = pScreen->CloseScreen(scrnIndex, pScreen);
 
@@ -769,7 +1234,8 @@ qxl_switch_mode(int scrnIndex, DisplayModePtr p, int flags)
 	qxl_surface_kill (qxl->primary);
 	qxl_surface_cache_sanity_check (qxl->surface_cache);
     }
-	
+
+    qxl_ring_flush (qxl->command_ring);
     qxl_reset (qxl);
     
     ErrorF ("done reset\n");
@@ -797,6 +1263,9 @@ qxl_switch_mode(int scrnIndex, DisplayModePtr p, int flags)
        qxl_drop_image_cache (qxl);
     }
 
+    /* Whatever was left of a release chain is gone with the memory */
+    qxl->release_chain = 0;
+
     if (qxl->surf_mem)
 	qxl_mem_free_all (qxl->surf_mem);
 
@@ -820,6 +1289,37 @@ enum ROPDescriptor
     ROPD_INVERS_RES = (1 <<10),
 };
 
+static void
+qxl_block_handler (int i, pointer block_data, pointer timeout, pointer read_mask)
+{
+    ScreenPtr pScreen = screenInfo.screens[i];
+    qxl_screen_t *qxl = xf86Screens[i]->driverPrivate;
+
+    /* Collect first: releasing surfaces can queue destroy commands.
+     * If releases are left over, don't sleep before getting to them
+     */
+    if (qxl_garbage_collect_some (qxl, GC_BLOCK_BUDGET) == GC_BLOCK_BUDGET)
+	AdjustWaitForDelay (timeout, 0);
+
+    /* Everything queued while handling requests goes out
+     * to the device before the server goes to sleep
+     */
+    qxl_ring_flush (qxl->command_ring);
+    qxl_ring_kick (qxl->command_ring);
+    qxl_ring_kick (qxl->cursor_ring);
+
+    pScreen->BlockHandler = qxl->block_handler;
+    (*pScreen->BlockHandler) (i, block_data, timeout, read_mask);
+    qxl->block_handler = pScreen->BlockHandler;
+    pScreen->BlockHandler = qxl_block_handler;
+
+    if (qxl->stats_request_seen != stats_requests)
+    {
+	qxl->stats_request_seen = stats_requests;
+	qxl_dump_stats (qxl, TRUE);
+    }
+}
+
 static Bool
 qxl_create_screen_resources(ScreenPtr pScreen)
 {
@@ -860,9 +1360,61 @@ unaccel (void)
     return FALSE;
 }
 
+/* Gives a lazy pixmap its surface, uploads what has been drawn into it
+ * by software so far and frees the system memory copy. If no surface
+ * can be had, the pixmap stays in system memory for good.
+ */
+static qxl_surface_t *
+realize_surface (PixmapPtr pixmap)
+{
+    ScreenPtr screen = pixmap->drawable.pScreen;
+    ScrnInfoPtr scrn = xf86Screens[screen->myNum];
+    qxl_screen_t *qxl = scrn->driverPrivate;
+    int width = pixmap->drawable.width;
+    int height = pixmap->drawable.height;
+    qxl_surface_t *surface;
+
+    if (!pixmap_is_lazy (pixmap))
+	return get_surface (pixmap);
+
+    if (uxa_swapped_out (screen))
+	return NULL;
+
+    surface = qxl_surface_create (qxl->surface_cache,
+				  width, height, pixmap->drawable.depth);
+
+    if (!surface)
+    {
+	set_surface (pixmap, NO_SURFACE);
+	return NULL;
+    }
+
+#if 0
+    ErrorF ("Realize pixmap %p with surface %p\n", pixmap, surface);
+#endif
+
+    qxl_surface_put_image (surface, 0, 0, width, height,
+			   pixmap->devPrivate.ptr, pixmap->devKind);
+
+    /* From now on the data is only reached through prepare_access */
+    free (pixmap->devPrivate.ptr);
+    screen->ModifyPixmapHeader (pixmap, width, height, -1, -1, -1, NULL);
+
+    set_surface (pixmap, surface);
+    qxl_surface_set_pixmap (surface, pixmap);
+
+    qxl->n_lazy_realized++;
+
+    return surface;
+}
+
 static Bool
 qxl_prepare_access (PixmapPtr pixmap, RegionPtr region, uxa_access_t access)
 {
+    /* Lazy pixmaps are in system memory already */
+    if (pixmap_is_lazy (pixmap))
+	return TRUE;
+
     return qxl_surface_prepare_access (get_surface (pixmap),
 				       pixmap, region, access);
 }
@@ -870,13 +1422,16 @@ qxl_prepare_access (PixmapPtr pixmap, RegionPtr region, uxa_access_t access)
 static void
 qxl_finish_access (PixmapPtr pixmap)
 {
+    if (pixmap_is_lazy (pixmap))
+	return;
+
     qxl_surface_finish_access (get_surface (pixmap), pixmap);
 }
 
 static Bool
 qxl_pixmap_is_offscreen (PixmapPtr pixmap)
 {
-    return !!get_surface (pixmap);
+    return get_surface (pixmap) || pixmap_is_lazy (pixmap);
 }
 
 
@@ -909,7 +1464,7 @@ qxl_prepare_solid (PixmapPtr pixmap, int alu, Pixel planemask, Pixel fg)
 {
     qxl_surface_t *surface;
     
-    if (!(surface = get_surface (pixmap)))
+    if (!(surface = realize_surface (pixmap)))
 	return FALSE;
     
     return qxl_surface_prepare_solid (surface, fg);
@@ -950,6 +1505,12 @@ qxl_prepare_copy (PixmapPtr source, PixmapPtr dest,
 		  int xdir, int ydir, int alu,
 		  Pixel planemask)
 {
+    /* Creating a surface can relocate others (see compact_vram), so
+     * both are looked up again once both exist
+     */
+    if (!realize_surface (dest) || !realize_surface (source))
+	return FALSE;
+
     return qxl_surface_prepare_copy (get_surface (dest), get_surface (source));
 }
 
@@ -974,7 +1535,7 @@ static Bool
 qxl_put_image (PixmapPtr pDst, int x, int y, int w, int h,
 	       char *src, int src_pitch)
 {
-    qxl_surface_t *surface = get_surface (pDst);
+    qxl_surface_t *surface = realize_surface (pDst);
 
     if (surface)
 	return qxl_surface_put_image (surface, x, y, w, h, src, src_pitch);
@@ -1007,6 +1568,36 @@ qxl_create_pixmap (ScreenPtr screen, int w, int h, int depth, unsigned usage)
 
     if (uxa_swapped_out (screen))
 	goto fallback;
+
+    /* Pixmaps that are created, drawn by software and freed again
+     * never need a surface, so with LazySurfaces it is only created
+     * when the pixmap is first drawn to or copied from by the device.
+     */
+    if (qxl->lazy_surfaces && qxl->enable_surfaces && w > 0 && h > 0)
+    {
+	int stride;
+	void *data;
+
+	/* The data is allocated separately, so that it can be freed
+	 * once the pixmap has a surface
+	 */
+	if (!(pixmap = fbCreatePixmap (screen, 0, 0, depth, usage)))
+	    return NULL;
+
+	stride = ((w * pixmap->drawable.bitsPerPixel + 31) >> 5) * 4;
+
+	if (!(data = malloc ((size_t)stride * h)))
+	{
+	    fbDestroyPixmap (pixmap);
+	    return NULL;
+	}
+
+	screen->ModifyPixmapHeader (pixmap, w, h, -1, -1, stride, data);
+	set_surface (pixmap, LAZY_SURFACE);
+
+	qxl->n_lazy_created++;
+	return pixmap;
+    }
     
     surface = qxl_surface_create (qxl->surface_cache, w, h, depth);
     
@@ -1070,6 +1661,11 @@ qxl_destroy_pixmap (PixmapPtr pixmap)
 
 	    qxl_surface_cache_sanity_check (qxl->surface_cache);
 	}
+	else if (pixmap_has_own_data (pixmap))
+	{
+	    free (pixmap->devPrivate.ptr);
+	    set_surface (pixmap, NULL);
+	}
     }
     
     fbDestroyPixmap (pixmap);
@@ -1178,6 +1774,7 @@ qxl_screen_init(int scrnIndex, ScreenPtr pScreen, int argc, char **argv)
     ScrnInfoPtr pScrn = xf86Screens[scrnIndex];
     qxl_screen_t *qxl = pScrn->driverPrivate;
     struct QXLRam *ram_header;
+    unsigned long image_cache_bytes;
     VisualPtr visual;
 
     CHECK_POINT();
@@ -1270,6 +1867,14 @@ qxl_screen_init(int scrnIndex, ScreenPtr pScreen, int argc, char **argv)
 					 QXL_RELEASE_RING_SIZE, 0, qxl,"release");
 
     qxl->surface_cache = qxl_surface_cache_create (qxl);
+
+    /* By default cached images may use a quarter of command memory */
+    if (qxl->image_cache_size >= 0)
+	image_cache_bytes = (unsigned long)qxl->image_cache_size * 1024;
+    else
+	image_cache_bytes = (qxl->rom->num_pages * getpagesize() - qxl->surface0_size) / 4;
+
+    qxl->image_cache = qxl_image_cache_create (qxl, image_cache_bytes);
     
     /* xf86DPMSInit(pScreen, xf86DPMSSet, 0); */
     
@@ -1295,6 +1900,17 @@ qxl_screen_init(int scrnIndex, ScreenPtr pScreen, int argc, char **argv)
     
     qxl->close_screen = pScreen->CloseScreen;
     pScreen->CloseScreen = qxl_close_screen;
+
+    qxl->block_handler = pScreen->BlockHandler;
+    pScreen->BlockHandler = qxl_block_handler;
+
+    if (qxl->stats_interval > 0)
+    {
+	qxl->stats_timer = TimerSet (NULL, 0, qxl->stats_interval * 1000,
+				     qxl_stats_timer_callback, qxl);
+    }
+
+    qxl_stats_signal_init (qxl);
     
     qxl_cursor_init (pScreen);
 
@@ -1344,6 +1960,7 @@ qxl_leave_vt(int scrnIndex, int flags)
 
     qxl->vt_surfaces = qxl_surface_cache_evacuate_all (qxl->surface_cache);
 
+    qxl_ring_flush (qxl->command_ring);
     outb(qxl->io_base + QXL_IO_RESET, 0);
 
     qxl_restore_state(pScrn);
@@ -1556,6 +2173,12 @@ qxl_pre_init(ScrnInfoPtr pScrn, int flags)
 	pScrn->driverPrivate = xnfcalloc(sizeof(qxl_screen_t), 1);
     qxl = pScrn->driverPrivate;
 
+    qxl_waiter_init (&qxl->io_waiter);
+    qxl_waiter_init (&qxl->oom_waiter);
+#ifdef XSPICE
+    qxl->event_fd = -1;
+#endif
+
     qxl->entity = xf86GetEntityInfo(pScrn->entityList[0]);
 
 #if !defined XSPICE && !defined VIRTIO_QXL
@@ -1581,13 +2204,33 @@ qxl_pre_init(ScrnInfoPtr pScrn, int flags)
 	xf86ReturnOptValBool (qxl->options, OPTION_ENABLE_FALLBACK_CACHE, FALSE);
     qxl->enable_surfaces =
 	xf86ReturnOptValBool (qxl->options, OPTION_ENABLE_SURFACES, FALSE);
+    qxl->defer_notify =
+	xf86ReturnOptValBool (qxl->options, OPTION_DEFER_NOTIFY, FALSE);
+    qxl->lazy_surfaces =
+	xf86ReturnOptValBool (qxl->options, OPTION_LAZY_SURFACES, FALSE);
+    if (!xf86GetOptValInteger (qxl->options, OPTION_STATS_INTERVAL,
+			       &qxl->stats_interval))
+	qxl->stats_interval = 0;
+    if (!xf86GetOptValInteger (qxl->options, OPTION_IMAGE_CACHE_SIZE,
+			       &qxl->image_cache_size))
+	qxl->image_cache_size = -1;
 
     xf86DrvMsg(scrnIndex, X_INFO, "Offscreen Surfaces: %s\n",
 	       qxl->enable_surfaces? "Enabled" : "Disabled");
+    xf86DrvMsg(scrnIndex, X_INFO, "Lazy Surfaces: %s\n",
+	       qxl->lazy_surfaces? "Enabled" : "Disabled");
     xf86DrvMsg(scrnIndex, X_INFO, "Image Cache: %s\n",
 	       qxl->enable_image_cache? "Enabled" : "Disabled");
     xf86DrvMsg(scrnIndex, X_INFO, "Fallback Cache: %s\n",
 	       qxl->enable_fallback_cache? "Enabled" : "Disabled");
+    xf86DrvMsg(scrnIndex, X_INFO, "Deferred Notify: %s\n",
+	       qxl->defer_notify? "Enabled" : "Disabled");
+    if (qxl->stats_interval > 0)
+	xf86DrvMsg(scrnIndex, X_INFO, "Statistics every %d seconds\n",
+		   qxl->stats_interval);
+    if (qxl->image_cache_size >= 0)
+	xf86DrvMsg(scrnIndex, X_INFO, "Image Cache Size: %d KB\n",
+		   qxl->image_cache_size);
     
 #ifdef VIRTIO_QXL
     qxl->device_name = xf86FindOptionValue(pScrn->options,"virtiodev");
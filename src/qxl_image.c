@@ -30,55 +30,406 @@
 #include "qxl.h"
 #include "murmurhash3.h"
 
+/* The PCI device maps command RAM write-combined, so pixel data copied
+ * there is written with streaming stores that don't pollute the cache.
+ * XSpice and virtio command RAM is ordinary memory that gets read
+ * again soon, so those builds use plain stores.
+ */
+#if defined(__x86_64__) && !defined XSPICE && !defined VIRTIO_QXL
+#include <emmintrin.h>
+#define USE_STREAMING_STORES
+#ifdef HAVE_AVX2_DISPATCH
+#include <immintrin.h>
+#endif
+#endif
+
 typedef struct image_info_t image_info_t;
+typedef struct palette_info_t palette_info_t;
 
+/* The key is kept here as well as in the image descriptor, so that
+ * table walks don't read the image back from device memory
+ */
 struct image_info_t
 {
     struct QXLImage *image;
+    uint64_t id;
+    int width;
+    int height;
+    int format;			/* of the source pixels */
     int ref_count;
+    unsigned long n_bytes;
     image_info_t *next;
+
+    /* Unreferenced images stay in the cache on the LRU list
+     * until they are evicted
+     */
+    image_info_t *lru_prev;
+    image_info_t *lru_next;
 };
 
-#define HASH_SIZE 4096
-static image_info_t *image_table[HASH_SIZE];
+/* Palettes are shared by all images with the same colours. The key
+ * and colours are kept here as well, so that lookups don't read the
+ * palette back from device memory. Each palette is also hashed by its
+ * address, which is all that freeing an image has to go by.
+ */
+struct palette_info_t
+{
+    struct QXLPalette *palette;
+    int ref_count;
+    palette_info_t *next;
+    palette_info_t *addr_next;
 
-static unsigned int
+    uint64_t unique;
+    int n_colors;
+    uint32_t colors[0];
+};
+
+#define PALETTE_BUCKETS		64
+
+struct image_cache_t
+{
+    qxl_screen_t *	qxl;
+
+    image_info_t **	buckets;
+    unsigned int	n_buckets;	/* always a power of two */
+    unsigned int	n_entries;
+
+    image_info_t *	lru_head;	/* most recently released */
+    image_info_t *	lru_tail;
+
+    unsigned long	n_bytes;
+    unsigned long	max_bytes;
+
+    unsigned long	n_hits;
+    unsigned long	n_misses;
+    unsigned long	n_evictions;
+    unsigned long	n_rejected;
+
+    /* Recent hit rate, decides whether to hash before copying */
+    unsigned int	recent_lookups;
+    unsigned int	recent_hits;
+
+    palette_info_t *	palettes[PALETTE_BUCKETS];
+    palette_info_t *	palette_addrs[PALETTE_BUCKETS];
+    unsigned long	n_palettized;
+};
+
+#define INITIAL_BUCKETS		256
+#define MAX_LOAD		2
+
+/* Images smaller than this are cheaper to copy than to look up, and
+ * images larger than max_bytes / MAX_FRACTION would flush everything
+ * else out of the cache
+ */
+#define MIN_CACHED_BYTES	1024
+#define MAX_FRACTION		8
+
+/* Image ids are 64 bit content hashes. Each line goes through the
+ * 128 bit MurmurHash3, seeded from the hash so far, and the digest is
+ * folded into the running hash. The initial value covers the size and
+ * format, so equal bytes with a different shape give different ids.
+ */
+#define HASH_MULTIPLIER 0x87c37b91114253d5ULL
+
+static uint64_t
+initial_hash (int width, int height, int format)
+{
+    uint64_t hash = ((uint64_t)width << 32) | (uint32_t)height;
+
+    return (hash ^ format) * HASH_MULTIPLIER;
+}
+
+#define C1 0x87c37b91114253d5ULL
+#define C2 0x4cf5ad432745937fULL
+
+static inline uint64_t
+rotl64 (uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+fmix64 (uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+
+    return k;
+}
+
+/* One 16 byte block of the MurmurHash3_x64_128 body */
+static inline void
+mix_block (uint64_t *h1, uint64_t *h2, uint64_t k1, uint64_t k2)
+{
+    k1 *= C1; k1 = rotl64 (k1, 31); k1 *= C2; *h1 ^= k1;
+
+    *h1 = rotl64 (*h1, 27); *h1 += *h2; *h1 = *h1 * 5 + 0x52dce729;
+
+    k2 *= C2; k2 = rotl64 (k2, 33); k2 *= C1; *h2 ^= k2;
+
+    *h2 = rotl64 (*h2, 31); *h2 += *h1; *h2 = *h2 * 5 + 0x38495ab5;
+}
+
+static inline void
+store_64 (uint8_t *dest, uint64_t v)
+{
+#ifdef USE_STREAMING_STORES
+    _mm_stream_si64 ((long long *)dest, (long long)v);
+#else
+    memcpy (dest, &v, sizeof v);
+#endif
+}
+
+/* Block kernels: copy @nblocks 16 byte blocks from @src to @dest
+ * and mix each into the hash as it goes by. The hash is a serial
+ * chain of multiplies, so vectors only help with the loads and
+ * stores: one per block, or per two blocks, instead of two each.
+ */
+typedef void (* copy_blocks_func_t) (const uint8_t *src, uint8_t *dest,
+				     int nblocks, uint64_t *h1, uint64_t *h2);
+
+static void
+copy_blocks_plain (const uint8_t *src, uint8_t *dest, int nblocks,
+		   uint64_t *h1, uint64_t *h2)
+{
+    uint64_t k1, k2;
+    int i;
+
+    for (i = 0; i < nblocks; ++i)
+    {
+	memcpy (&k1, src + i * 16, sizeof k1);
+	memcpy (&k2, src + i * 16 + 8, sizeof k2);
+
+	store_64 (dest + i * 16, k1);
+	store_64 (dest + i * 16 + 8, k2);
+
+	mix_block (h1, h2, k1, k2);
+    }
+}
+
+#ifdef USE_STREAMING_STORES
+
+/* @dest must be 16 byte aligned */
+static void
+copy_blocks_sse2 (const uint8_t *src, uint8_t *dest, int nblocks,
+		  uint64_t *h1, uint64_t *h2)
+{
+    int i;
+
+    for (i = 0; i < nblocks; ++i)
+    {
+	__m128i x = _mm_loadu_si128 ((const __m128i *)(src + i * 16));
+
+	_mm_stream_si128 ((__m128i *)(dest + i * 16), x);
+
+	mix_block (h1, h2, _mm_cvtsi128_si64 (x),
+		   _mm_cvtsi128_si64 (_mm_unpackhi_epi64 (x, x)));
+    }
+}
+
+#ifdef HAVE_AVX2_DISPATCH
+
+/* @dest must be 32 byte aligned */
+__attribute__((target ("avx2")))
+static void
+copy_blocks_avx2 (const uint8_t *src, uint8_t *dest, int nblocks,
+		  uint64_t *h1, uint64_t *h2)
+{
+    int i;
+
+    for (i = 0; i + 2 <= nblocks; i += 2)
+    {
+	__m256i y = _mm256_loadu_si256 ((const __m256i *)(src + i * 16));
+	__m128i lo = _mm256_castsi256_si128 (y);
+	__m128i hi = _mm256_extracti128_si256 (y, 1);
+
+	_mm256_stream_si256 ((__m256i *)(dest + i * 16), y);
+
+	mix_block (h1, h2, _mm_cvtsi128_si64 (lo), _mm_extract_epi64 (lo, 1));
+	mix_block (h1, h2, _mm_cvtsi128_si64 (hi), _mm_extract_epi64 (hi, 1));
+    }
+
+    if (i < nblocks)
+	copy_blocks_sse2 (src + i * 16, dest + i * 16, 1, h1, h2);
+}
+
+#endif
+
+/* Picks the widest kernel the CPU and the alignment of @dest allow.
+ * Lines whose destination is not 16 byte aligned, which depends on
+ * the image stride, use the 8 byte stores of the plain kernel.
+ */
+static copy_blocks_func_t
+select_copy_blocks (const uint8_t *dest)
+{
+#ifdef HAVE_AVX2_DISPATCH
+    static int have_avx2 = -1;
+
+    if (have_avx2 < 0)
+    {
+	__builtin_cpu_init ();
+
+	have_avx2 = !!__builtin_cpu_supports ("avx2");
+    }
+
+    if (have_avx2 && ((uintptr_t)dest & 31) == 0)
+	return copy_blocks_avx2;
+#endif
+
+    if (((uintptr_t)dest & 15) == 0)
+	return copy_blocks_sse2;
+
+    return copy_blocks_plain;
+}
+
+#else
+
+static copy_blocks_func_t
+select_copy_blocks (const uint8_t *dest)
+{
+    return copy_blocks_plain;
+}
+
+#endif
+
+/* MurmurHash3_x64_128 of one line that also copies the line to @dest.
+ * Each 16 byte block is loaded once, stored and mixed, so the source
+ * is only read once. The digest is identical to MurmurHash3_x64_128().
+ */
+static void
+hash_and_copy_line (const uint8_t *src, uint8_t *dest, int len,
+		    uint32_t seed, uint64_t out[2])
+{
+    const int nblocks = len / 16;
+    const uint8_t *tail;
+    uint64_t h1 = seed;
+    uint64_t h2 = seed;
+    uint64_t k1, k2;
+
+    select_copy_blocks (dest) (src, dest, nblocks, &h1, &h2);
+
+    tail = src + nblocks * 16;
+    memcpy (dest + nblocks * 16, tail, len & 15);
+
+    k1 = 0;
+    k2 = 0;
+
+    switch (len & 15)
+    {
+    case 15: k2 ^= ((uint64_t)tail[14]) << 48;	/* fall through */
+    case 14: k2 ^= ((uint64_t)tail[13]) << 40;	/* fall through */
+    case 13: k2 ^= ((uint64_t)tail[12]) << 32;	/* fall through */
+    case 12: k2 ^= ((uint64_t)tail[11]) << 24;	/* fall through */
+    case 11: k2 ^= ((uint64_t)tail[10]) << 16;	/* fall through */
+    case 10: k2 ^= ((uint64_t)tail[ 9]) << 8;	/* fall through */
+    case  9: k2 ^= ((uint64_t)tail[ 8]) << 0;
+	     k2 *= C2; k2 = rotl64 (k2, 33); k2 *= C1; h2 ^= k2;	/* fall through */
+
+    case  8: k1 ^= ((uint64_t)tail[ 7]) << 56;	/* fall through */
+    case  7: k1 ^= ((uint64_t)tail[ 6]) << 48;	/* fall through */
+    case  6: k1 ^= ((uint64_t)tail[ 5]) << 40;	/* fall through */
+    case  5: k1 ^= ((uint64_t)tail[ 4]) << 32;	/* fall through */
+    case  4: k1 ^= ((uint64_t)tail[ 3]) << 24;	/* fall through */
+    case  3: k1 ^= ((uint64_t)tail[ 2]) << 16;	/* fall through */
+    case  2: k1 ^= ((uint64_t)tail[ 1]) << 8;	/* fall through */
+    case  1: k1 ^= ((uint64_t)tail[ 0]) << 0;
+	     k1 *= C1; k1 = rotl64 (k1, 31); k1 *= C2; h1 ^= k1;
+    };
+
+    h1 ^= len; h2 ^= len;
+
+    h1 += h2;
+    h2 += h1;
+
+    h1 = fmix64 (h1);
+    h2 = fmix64 (h2);
+
+    h1 += h2;
+    h2 += h1;
+
+    out[0] = h1;
+    out[1] = h2;
+}
+
+static uint64_t
 hash_and_copy (const uint8_t *src, int src_stride,
 	       uint8_t *dest, int dest_stride,
 	       int bytes_per_pixel, int width, int height,
-	       uint32_t hash)
+	       uint64_t hash)
 {
     int i;
   
     for (i = 0; i < height; ++i)
     {
 	const uint8_t *src_line = src + i * src_stride;
-	uint8_t *dest_line = dest + i * dest_stride;
 	int n_bytes = width * bytes_per_pixel;
+	uint32_t seed = (uint32_t)(hash ^ (hash >> 32));
+	uint64_t digest[2];
 
 	if (dest)
-	    memcpy (dest_line, src_line, n_bytes);
+	    hash_and_copy_line (src_line, dest + i * dest_stride, n_bytes, seed, digest);
+	else
+	    MurmurHash3_x64_128 (src_line, n_bytes, seed, digest);
 
-	MurmurHash3_x86_32 (src_line, n_bytes, hash, &hash);
+	hash = ((hash ^ digest[0]) * HASH_MULTIPLIER) ^ digest[1];
     }
 
+#ifdef USE_STREAMING_STORES
+    if (dest)
+	_mm_sfence ();
+#endif
+
     return hash;
 }
 
+static void
+copy_lines (const uint8_t *src, int src_stride,
+	    uint8_t *dest, int dest_stride,
+	    int n_bytes, int height)
+{
+    int i;
+
+    for (i = 0; i < height; ++i)
+	qxl_wc_memcpy_unfenced (dest + i * dest_stride, src + i * src_stride, n_bytes);
+
+    qxl_wc_fence ();
+}
+
+static int
+get_bitmap_format (int Bpp)
+{
+    if (Bpp == 2)
+	return SPICE_BITMAP_FMT_16BIT;
+    else if (Bpp == 1)
+	return SPICE_BITMAP_FMT_8BIT;
+    else if (Bpp == 4)
+	return SPICE_BITMAP_FMT_32BIT;
+
+    abort();
+}
+
+static unsigned int
+bucket_of (image_cache_t *cache, uint64_t id)
+{
+    return (uint32_t)(id ^ (id >> 32)) & (cache->n_buckets - 1);
+}
+
 static image_info_t *
-lookup_image_info (unsigned int hash,
+lookup_image_info (image_cache_t *cache,
+		   uint64_t hash,
 		   int width,
 		   int height)
 {
-    struct image_info_t *info = image_table[hash % HASH_SIZE];
+    struct image_info_t *info = cache->buckets[bucket_of (cache, hash)];
 
     while (info)
     {
-	struct QXLImage *image = info->image;
-
-	if (image->descriptor.id == hash		&&
-	    image->descriptor.width == width		&&
-	    image->descriptor.height == height)
+	if (info->id == hash		&&
+	    info->width == width	&&
+	    info->height == height)
 	{
 	    return info;
 	}
@@ -87,57 +438,655 @@ lookup_image_info (unsigned int hash,
     }
 
 #if 0
-    ErrorF ("lookup of %u failed\n", hash);
+    ErrorF ("lookup of %llx failed\n", (unsigned long long)hash);
 #endif
     
     return NULL;
 }
 
+static void
+resize_table (image_cache_t *cache)
+{
+    unsigned int n_buckets = cache->n_buckets * 2;
+    image_info_t **old_buckets = cache->buckets;
+    unsigned int old_n_buckets = cache->n_buckets;
+    unsigned int i;
+
+    if (!(cache->buckets = calloc (n_buckets, sizeof (image_info_t *))))
+    {
+	/* Keep the old table, it just gets slower */
+	cache->buckets = old_buckets;
+	return;
+    }
+
+    cache->n_buckets = n_buckets;
+
+    for (i = 0; i < old_n_buckets; ++i)
+    {
+	image_info_t *info = old_buckets[i];
+
+	while (info)
+	{
+	    image_info_t *next = info->next;
+	    unsigned int b = bucket_of (cache, info->id);
+
+	    info->next = cache->buckets[b];
+	    cache->buckets[b] = info;
+
+	    info = next;
+	}
+    }
+
+    free (old_buckets);
+}
+
 static image_info_t *
-insert_image_info (unsigned int hash)
+insert_image_info (image_cache_t *cache, uint64_t hash, int width, int height)
 {
     struct image_info_t *info = malloc (sizeof (image_info_t));
+    unsigned int b;
 
     if (!info)
 	return NULL;
 
-    info->next = image_table[hash % HASH_SIZE];
-    image_table[hash % HASH_SIZE] = info;
+    if (cache->n_entries >= cache->n_buckets * MAX_LOAD)
+	resize_table (cache);
+
+    b = bucket_of (cache, hash);
+
+    info->id = hash;
+    info->width = width;
+    info->height = height;
+    info->next = cache->buckets[b];
+    info->lru_prev = info->lru_next = NULL;
+    cache->buckets[b] = info;
+    cache->n_entries++;
     
     return info;
 }
 
 static void
-remove_image_info (image_info_t *info)
+remove_image_info (image_cache_t *cache, image_info_t *info)
 {
-    struct image_info_t **location = &image_table[info->image->descriptor.id % HASH_SIZE];
+    struct image_info_t **location =
+	&cache->buckets[bucket_of (cache, info->id)];
 
     while (*location && (*location) != info)
 	location = &((*location)->next);
 
     if (*location)
+    {
 	*location = info->next;
+	cache->n_entries--;
+	cache->n_bytes -= info->n_bytes;
+    }
 
     free (info);
 }
 
+static void
+lru_unlink (image_cache_t *cache, image_info_t *info)
+{
+    if (info->lru_prev)
+	info->lru_prev->lru_next = info->lru_next;
+    else
+	cache->lru_head = info->lru_next;
+
+    if (info->lru_next)
+	info->lru_next->lru_prev = info->lru_prev;
+    else
+	cache->lru_tail = info->lru_prev;
+
+    info->lru_prev = info->lru_next = NULL;
+}
+
+static void
+lru_push (image_cache_t *cache, image_info_t *info)
+{
+    info->lru_prev = NULL;
+    info->lru_next = cache->lru_head;
+
+    if (cache->lru_head)
+	cache->lru_head->lru_prev = info;
+    else
+	cache->lru_tail = info;
+
+    cache->lru_head = info;
+}
+
+/*
+ * Palettes
+ */
+static unsigned int
+palette_addr_bucket (struct QXLPalette *palette)
+{
+    return ((uintptr_t)palette >> 4) % PALETTE_BUCKETS;
+}
+
+static struct QXLPalette *
+get_palette (image_cache_t *cache, const uint32_t *colors, int n_colors)
+{
+    qxl_screen_t *qxl = cache->qxl;
+    palette_info_t *pinfo;
+    struct QXLPalette *palette;
+    uint64_t digest[2];
+    uint64_t unique;
+    unsigned int b;
+
+    MurmurHash3_x64_128 (colors, n_colors * sizeof (uint32_t), n_colors, digest);
+    unique = digest[0] ^ digest[1];
+    if (!unique)
+	unique = 1;
+
+    b = unique % PALETTE_BUCKETS;
+
+    for (pinfo = cache->palettes[b]; pinfo; pinfo = pinfo->next)
+    {
+	if (pinfo->unique == unique				&&
+	    pinfo->n_colors == n_colors				&&
+	    memcmp (pinfo->colors, colors, n_colors * sizeof (uint32_t)) == 0)
+	{
+	    pinfo->ref_count++;
+	    return pinfo->palette;
+	}
+    }
+
+    if (!(pinfo = malloc (sizeof *pinfo + n_colors * sizeof (uint32_t))))
+	return NULL;
+
+    palette = qxl_allocnf (qxl, sizeof *palette + n_colors * sizeof (uint32_t));
+
+    palette->unique = unique;
+    palette->num_ents = n_colors;
+    qxl_wc_memcpy (palette->ents, colors, n_colors * sizeof (uint32_t));
+
+    pinfo->palette = palette;
+    pinfo->ref_count = 1;
+    pinfo->unique = unique;
+    pinfo->n_colors = n_colors;
+    memcpy (pinfo->colors, colors, n_colors * sizeof (uint32_t));
+    pinfo->next = cache->palettes[b];
+    cache->palettes[b] = pinfo;
+
+    b = palette_addr_bucket (palette);
+    pinfo->addr_next = cache->palette_addrs[b];
+    cache->palette_addrs[b] = pinfo;
+
+    return palette;
+}
+
+/* Finds the palette by its address, so this never reads the palette
+ * in device memory
+ */
+static void
+put_palette (image_cache_t *cache, struct QXLPalette *palette)
+{
+    palette_info_t **location = &cache->palette_addrs[palette_addr_bucket (palette)];
+    palette_info_t *pinfo;
+
+    while (*location && (*location)->palette != palette)
+	location = &((*location)->addr_next);
+
+    if (!*location || --(*location)->ref_count != 0)
+	return;
+
+    pinfo = *location;
+    *location = pinfo->addr_next;
+
+    location = &cache->palettes[pinfo->unique % PALETTE_BUCKETS];
+    while (*location != pinfo)
+	location = &((*location)->next);
+    *location = pinfo->next;
+
+    qxl_free (cache->qxl->mem, palette);
+    free (pinfo);
+}
+
+static void
+free_chunks (qxl_screen_t *qxl, uint64_t chunk)
+{
+    while (chunk)
+    {
+	struct QXLDataChunk *virtual;
+
+	virtual = virtual_address (qxl, u64_to_pointer (chunk), qxl->main_mem_slot);
+
+	chunk = virtual->next_chunk;
+
+	qxl_free (qxl->mem, virtual);
+    }
+}
+
+static void
+free_image (qxl_screen_t *qxl, struct QXLImage *image)
+{
+    if (image->bitmap.palette && qxl->image_cache)
+    {
+	put_palette (qxl->image_cache,
+		     virtual_address (qxl, u64_to_pointer (image->bitmap.palette),
+				      qxl->main_mem_slot));
+    }
+
+    free_chunks (qxl, image->bitmap.data);
+    
+    qxl_slab_free (qxl->mem, image);
+}
+
+static void
+record_lookup (image_cache_t *cache, Bool hit)
+{
+    if (hit)
+    {
+	cache->n_hits++;
+	cache->recent_hits++;
+    }
+    else
+    {
+	cache->n_misses++;
+    }
+
+    if (++cache->recent_lookups == 256)
+    {
+	cache->recent_lookups /= 2;
+	cache->recent_hits /= 2;
+    }
+}
+
+/* Whether a lookup is likely to hit. If it is, we hash before copying
+ * so a hit costs no device memory; if not, hashing while copying
+ * reads the source only once.
+ */
+static Bool
+hit_likely (image_cache_t *cache)
+{
+    return cache->recent_hits * 8 >= cache->recent_lookups;
+}
+
+/* Frees the least recently used unreferenced image. Returns FALSE
+ * if there was nothing to evict.
+ */
+static Bool
+evict_one (image_cache_t *cache)
+{
+    image_info_t *info = cache->lru_tail;
+    struct QXLImage *image;
+
+    if (!info)
+	return FALSE;
+
+    image = info->image;
+
+#if 0
+    ErrorF ("evicting %p\n", image);
+#endif
+
+    lru_unlink (cache, info);
+    remove_image_info (cache, info);
+    free_image (cache->qxl, image);
+
+    cache->n_evictions++;
+
+    return TRUE;
+}
+
+static void
+forget_all (image_cache_t *cache)
+{
+    unsigned int i;
+
+    for (i = 0; i < cache->n_buckets; ++i)
+    {
+	image_info_t *info = cache->buckets[i];
+
+	while (info)
+	{
+	    image_info_t *next = info->next;
+
+	    free (info);
+
+	    info = next;
+	}
+
+	cache->buckets[i] = NULL;
+    }
+
+    for (i = 0; i < PALETTE_BUCKETS; ++i)
+    {
+	palette_info_t *pinfo = cache->palettes[i];
+
+	while (pinfo)
+	{
+	    palette_info_t *next = pinfo->next;
+
+	    free (pinfo);
+
+	    pinfo = next;
+	}
+
+	cache->palettes[i] = NULL;
+	cache->palette_addrs[i] = NULL;
+    }
+
+    cache->n_entries = 0;
+    cache->n_bytes = 0;
+    cache->lru_head = cache->lru_tail = NULL;
+}
+
+image_cache_t *
+qxl_image_cache_create (qxl_screen_t *qxl, unsigned long max_bytes)
+{
+    image_cache_t *cache = calloc (1, sizeof *cache);
+
+    if (!cache)
+	return NULL;
+
+    if (!(cache->buckets = calloc (INITIAL_BUCKETS, sizeof (image_info_t *))))
+    {
+	free (cache);
+	return NULL;
+    }
+
+    cache->qxl = qxl;
+    cache->n_buckets = INITIAL_BUCKETS;
+    cache->max_bytes = max_bytes;
+
+    return cache;
+}
+
+/* Only the bookkeeping is freed; the images themselves live in
+ * device memory, which is going away along with the cache
+ */
+void
+qxl_image_cache_destroy (image_cache_t *cache)
+{
+    if (!cache)
+	return;
+
+    forget_all (cache);
+
+    free (cache->buckets);
+    free (cache);
+}
+
+/* Frees all images that are not referenced by a drawable. Returns
+ * the number of images freed.
+ */
+int
+qxl_image_cache_evict (image_cache_t *cache)
+{
+    int n = 0;
+
+    if (!cache)
+	return 0;
+
+    while (evict_one (cache))
+	++n;
+
+    return n;
+}
+
+void
+qxl_image_cache_dump_stats (image_cache_t *cache)
+{
+    unsigned long n_lookups;
+
+    if (!cache)
+	return;
+
+    n_lookups = cache->n_hits + cache->n_misses;
+
+    xf86DrvMsg (cache->qxl->pScrn->scrnIndex, X_INFO,
+		"Image cache: %u entries in %u buckets, %lu/%lu KB, "
+		"%lu hits, %lu misses (%lu%%), %lu evictions, %lu rejected, "
+		"%lu palettized\n",
+		cache->n_entries, cache->n_buckets,
+		cache->n_bytes / 1024, cache->max_bytes / 1024,
+		cache->n_hits, cache->n_misses,
+		n_lookups? cache->n_hits * 100 / n_lookups : 0,
+		cache->n_evictions, cache->n_rejected, cache->n_palettized);
+}
+
 #define MAX(a,b)  (((a) > (b))? (a) : (b))
 #define MIN(a,b)  (((a) < (b))? (a) : (b))
 
+/*
+ * Low colour images are sent as 8, 4 or 1 bit indexed bitmaps with a
+ * palette, which makes them a quarter of the size or less. The top
+ * byte of 32 bit pixels is ignored, as it is for SPICE_BITMAP_FMT_32BIT.
+ */
+#define PALETTE_BITS		9
+#define PALETTE_SLOTS		(1 << PALETTE_BITS)
+#define PALETTE_EMPTY		0xffffffff
+#define MIN_PALETTE_PIXELS	256
+
+typedef struct
+{
+    int		n_colors;
+    uint32_t	colors[256];
+    uint32_t	keys[PALETTE_SLOTS];
+    uint8_t	indices[PALETTE_SLOTS];
+} palette_builder_t;
+
+/* Returns the index of @color, adding it if necessary, or -1 if
+ * the palette is already full
+ */
+static int
+palette_index (palette_builder_t *pb, uint32_t color)
+{
+    unsigned int slot = (color * 2654435761u) >> (32 - PALETTE_BITS);
+
+    while (pb->keys[slot] != PALETTE_EMPTY)
+    {
+	if (pb->keys[slot] == color)
+	    return pb->indices[slot];
+
+	slot = (slot + 1) & (PALETTE_SLOTS - 1);
+    }
+
+    if (pb->n_colors == 256)
+	return -1;
+
+    pb->keys[slot] = color;
+    pb->indices[slot] = pb->n_colors;
+    pb->colors[pb->n_colors] = color;
+
+    return pb->n_colors++;
+}
+
+/* Collects the colours of a 32 bit image. Gives up as soon as there
+ * are more than 256 of them, so photos and gradients cost little.
+ */
+static Bool
+build_palette (palette_builder_t *pb, const uint8_t *data, int stride,
+	       int width, int height)
+{
+    uint32_t last = PALETTE_EMPTY;
+    int i, j;
+
+    pb->n_colors = 0;
+    memset (pb->keys, 0xff, sizeof pb->keys);
+
+    for (j = 0; j < height; ++j)
+    {
+	const uint32_t *line = (const uint32_t *)(data + j * stride);
+
+	for (i = 0; i < width; ++i)
+	{
+	    uint32_t color = line[i] & 0x00ffffff;
+
+	    if (color == last)
+		continue;
+
+	    if (palette_index (pb, color) < 0)
+		return FALSE;
+
+	    last = color;
+	}
+    }
+
+    return TRUE;
+}
+
+static void
+encode_line (palette_builder_t *pb, const uint32_t *src, uint8_t *dest,
+	     int width, int bits)
+{
+    int i;
+
+    if (bits == 8)
+    {
+	for (i = 0; i < width; ++i)
+	    dest[i] = palette_index (pb, src[i] & 0x00ffffff);
+    }
+    else
+    {
+	/* Big endian: the first pixel goes in the most significant bits */
+	memset (dest, 0, (width * bits + 7) / 8);
+
+	for (i = 0; i < width; ++i)
+	{
+	    int bit = i * bits;
+	    int index = palette_index (pb, src[i] & 0x00ffffff);
+
+	    dest[bit / 8] |= index << (8 - bits - bit % 8);
+	}
+    }
+}
+
+static struct QXLImage *
+ref_cached_image (image_cache_t *cache, uint64_t hash,
+		  int width, int height, int format)
+{
+    image_info_t *info = lookup_image_info (cache, hash, width, height);
+
+    if (info && info->format == format)
+    {
+	if (info->ref_count++ == 0)
+	    lru_unlink (cache, info);
+
+	record_lookup (cache, TRUE);
+
+#if 0
+	ErrorF ("reused %p with hash %llx\n", info->image,
+		(unsigned long long)hash);
+#endif
+	return info->image;
+    }
+
+    record_lookup (cache, FALSE);
+
+    return NULL;
+}
+
 struct QXLImage *
 qxl_image_create (qxl_screen_t *qxl, const uint8_t *data,
 		  int x, int y, int width, int height,
 		  int stride, int Bpp, Bool fallback)
 {
-	uint32_t hash;
+	uint64_t hash;
 	image_info_t *info;
 	struct QXLImage *image;
 	struct QXLDataChunk *head;
 	struct QXLDataChunk *tail;
+	struct QXLPalette *palette;
+	image_cache_t *image_cache = qxl->image_cache;
+	palette_builder_t pb;
 	int dest_stride = width * Bpp;
+	int format = get_bitmap_format (Bpp);
+	int dest_format = format;
+	int index_bits = 0;
+	uint8_t *index_line = NULL;
+	unsigned long n_bytes = (unsigned long)height * dest_stride + sizeof *image;
+	Bool cache;
+	Bool fused;
 	int h;
 
 	data += y * stride + x * Bpp;
+	palette = NULL;
+
+	cache = ((fallback && qxl->enable_fallback_cache)	||
+		 (!fallback && qxl->enable_image_cache));
+
+	if (cache && image_cache)
+	{
+	    if (n_bytes < MIN_CACHED_BYTES				||
+		n_bytes > image_cache->max_bytes / MAX_FRACTION)
+	    {
+		image_cache->n_rejected++;
+		cache = FALSE;
+	    }
+	}
+	else
+	{
+	    cache = FALSE;
+	}
+
+	/* If the same pixels are already in device memory, share them */
+	hash = initial_hash (width, height, format);
+	fused = cache && !hit_likely (image_cache);
+	if (cache && !fused)
+	{
+	    hash = hash_and_copy (data, stride, NULL, 0, Bpp, width, height, hash);
+
+	    if ((image = ref_cached_image (image_cache, hash, width, height, format)))
+		return image;
+	}
+
+	/* Few colours: send indices and a palette instead */
+	if (Bpp == 4 && image_cache					&&
+	    width * height >= MIN_PALETTE_PIXELS			&&
+	    build_palette (&pb, data, stride, width, height))
+	{
+	    if (pb.n_colors <= 2)
+	    {
+		index_bits = 1;
+		dest_format = SPICE_BITMAP_FMT_1BIT_BE;
+	    }
+	    else if (pb.n_colors <= 16)
+	    {
+		index_bits = 4;
+		dest_format = SPICE_BITMAP_FMT_4BIT_BE;
+	    }
+	    else
+	    {
+		index_bits = 8;
+		dest_format = SPICE_BITMAP_FMT_8BIT;
+	    }
+
+	    dest_stride = (width * index_bits + 7) / 8;
+
+	    if (!(index_line = malloc (dest_stride)))
+	    {
+		index_bits = 0;
+		dest_format = format;
+		dest_stride = width * Bpp;
+	    }
+	    else if (fused)
+	    {
+		/* Can't hash while copying when the copy is converted */
+		fused = FALSE;
+
+		hash = hash_and_copy (data, stride, NULL, 0, Bpp, width, height, hash);
+
+		if ((image = ref_cached_image (image_cache, hash, width, height, format)))
+		{
+		    free (index_line);
+		    return image;
+		}
+	    }
+
+	    if (index_bits &&
+		!(palette = get_palette (image_cache, pb.colors, pb.n_colors)))
+	    {
+		free (index_line);
+		index_line = NULL;
+		index_bits = 0;
+		dest_format = format;
+		dest_stride = width * Bpp;
+	    }
+	}
+
+	n_bytes = (unsigned long)height * dest_stride + sizeof *image;
 
 #if 0
 	ErrorF ("Must create new image of size %d %d\n", width, height);
@@ -149,7 +1098,6 @@ qxl_image_create (qxl_screen_t *qxl, const uint8_t *data,
 
 	head = tail = NULL;
 
-	hash = 0;
 	h = height;
 	while (h)
 	{
@@ -159,9 +1107,33 @@ qxl_image_create (qxl_screen_t *qxl, const uint8_t *data,
 		qxl_allocnf (qxl, sizeof *chunk + n_lines * dest_stride);
 
 	    chunk->data_size = n_lines * dest_stride;
-	    hash = hash_and_copy (data, stride,
-				  chunk->data, dest_stride,
-				  Bpp, width, n_lines, hash);
+	    if (index_bits)
+	    {
+		int i;
+
+		/* Encode into ordinary memory; device memory is for
+		 * writing only
+		 */
+		for (i = 0; i < n_lines; ++i)
+		{
+		    encode_line (&pb, (const uint32_t *)(data + i * stride),
+				 index_line, width, index_bits);
+		    qxl_wc_memcpy_unfenced (chunk->data + i * dest_stride,
+					    index_line, dest_stride);
+		}
+
+		qxl_wc_fence ();
+	    }
+	    else if (fused)
+	    {
+		hash = hash_and_copy (data, stride, chunk->data, dest_stride,
+				      Bpp, width, n_lines, hash);
+	    }
+	    else
+	    {
+		copy_lines (data, stride, chunk->data, dest_stride,
+			    dest_stride, n_lines);
+	    }
 	    
 	    if (tail)
 	    {
@@ -182,8 +1154,23 @@ qxl_image_create (qxl_screen_t *qxl, const uint8_t *data,
 	    h -= n_lines;
 	}
 
+	free (index_line);
+
+	/* A hit after all; the copy was wasted but is still correct */
+	if (fused)
+	{
+	    if ((image = ref_cached_image (image_cache, hash, width, height, format)))
+	    {
+		free_chunks (qxl, physical_address (qxl, head, qxl->main_mem_slot));
+		return image;
+	    }
+	}
+
+	if (index_bits)
+	    image_cache->n_palettized++;
+
 	/* Image */
-	image = qxl_allocnf (qxl, sizeof *image);
+	image = qxl_slab_allocnf (qxl, QXL_SLAB_IMAGE);
 
 	image->descriptor.id = 0;
 	image->descriptor.type = SPICE_IMAGE_TYPE_BITMAP;
@@ -192,48 +1179,45 @@ qxl_image_create (qxl_screen_t *qxl, const uint8_t *data,
 	image->descriptor.width = width;
 	image->descriptor.height = height;
 
-	if (Bpp == 2)
-	{
-	    image->bitmap.format = SPICE_BITMAP_FMT_16BIT;
-	}
-	else if (Bpp == 1)
-	{
-	    image->bitmap.format = SPICE_BITMAP_FMT_8BIT;
-	}
-	else if (Bpp == 4)
-	{
-	    image->bitmap.format = SPICE_BITMAP_FMT_32BIT;
-	}
-	else
-	{
-	    abort();
-	}
-
+	image->bitmap.format = dest_format;
 	image->bitmap.flags = SPICE_BITMAP_FLAGS_TOP_DOWN;
 	image->bitmap.x = width;
 	image->bitmap.y = height;
-	image->bitmap.stride = width * Bpp;
+	image->bitmap.stride = dest_stride;
 	image->bitmap.palette = 0;
 	image->bitmap.data = physical_address (qxl, head, qxl->main_mem_slot);
 
+	if (index_bits)
+	{
+	    image->bitmap.flags |= SPICE_BITMAP_FLAGS_PAL_CACHE_ME;
+	    image->bitmap.palette =
+		physical_address (qxl, palette, qxl->main_mem_slot);
+	}
+
 #if 0
 	ErrorF ("%p has size %d %d\n", image, width, height);
 #endif
 	
 	/* Add to hash table if caching is enabled */
-	if ((fallback && qxl->enable_fallback_cache)	||
-	    (!fallback && qxl->enable_image_cache))
+	if (cache)
 	{
-	    if ((info = insert_image_info (hash)))
+	    while (image_cache->n_bytes + n_bytes > image_cache->max_bytes &&
+		   evict_one (image_cache))
+		;
+
+	    if ((info = insert_image_info (image_cache, hash, width, height)))
 	    {
 		info->image = image;
+		info->format = format;
 		info->ref_count = 1;
+		info->n_bytes = n_bytes;
+		image_cache->n_bytes += n_bytes;
 
 		image->descriptor.id = hash;
 		image->descriptor.flags = QXL_IMAGE_CACHE;
 
 #if 0
-		ErrorF ("added with hash %u\n", hash);
+		ErrorF ("added with hash %llx\n", (unsigned long long)hash);
 #endif
 	    }
 	}
@@ -245,45 +1229,40 @@ void
 qxl_image_destroy (qxl_screen_t *qxl,
 		   struct QXLImage *image)
 {
-    image_info_t *info;
-    uint64_t chunk;
+    image_cache_t *cache = qxl->image_cache;
+    image_info_t *info = NULL;
 
-    info = lookup_image_info (image->descriptor.id,
-			      image->descriptor.width,
-			      image->descriptor.height);
-
-    if (info && info->image == image)
+    if (cache && (image->descriptor.flags & QXL_IMAGE_CACHE))
     {
-	--info->ref_count;
-
-	if (info->ref_count != 0)
-	    return;
-
-#if 0
-	ErrorF ("removed %p from hash table\n", info->image);
-#endif
-	
-	remove_image_info (info);
+	info = lookup_image_info (cache,
+				  image->descriptor.id,
+				  image->descriptor.width,
+				  image->descriptor.height);
     }
 
-    
-    chunk = image->bitmap.data;
-    while (chunk)
+    if (info && info->image == image)
     {
-	struct QXLDataChunk *virtual;
+	if (--info->ref_count != 0)
+	    return;
 
-	virtual = virtual_address (qxl, u64_to_pointer (chunk), qxl->main_mem_slot);
+	/* Keep it around in case the same pixels come back */
+	lru_push (cache, info);
 
-	chunk = virtual->next_chunk;
+	while (cache->n_bytes > cache->max_bytes && evict_one (cache))
+	    ;
 
-	qxl_free (qxl->mem, virtual);
+	return;
     }
-    
-    qxl_free (qxl->mem, image);
+
+    free_image (qxl, image);
 }
 
+/* Called after command memory has been wiped, so the images are
+ * already gone
+ */
 void
 qxl_drop_image_cache (qxl_screen_t *qxl)
 {
-    memset (image_table, 0, HASH_SIZE * sizeof (image_info_t *));
+    if (qxl->image_cache)
+	forget_all (qxl->image_cache);
 }
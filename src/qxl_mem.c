@@ -20,16 +20,242 @@
  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <string.h>
 #include "qxl.h"
 #include "mspace.h"
 
+#if defined(__x86_64__) && !defined XSPICE && !defined VIRTIO_QXL
+#include <emmintrin.h>
+#ifdef HAVE_SSE41_STREAM_LOAD
+#include <smmintrin.h>
+#endif
+#endif
+
+/*
+ * Fixed size command structures come from slabs: SLAB_SIZE aligned
+ * blocks of the mspace, cut into equal objects. All bookkeeping is
+ * kept in ordinary memory, so allocating and freeing never reads
+ * device memory, and objects have no headers. The slab an object
+ * belongs to is found from its address through mem->slab_map.
+ */
+#define SLAB_SIZE	16384
+#define SLAB_ALIGN	8
+
+typedef struct slab_t slab_t;
+typedef struct slab_cache_t slab_cache_t;
+
+struct slab_t
+{
+    uint8_t *		base;
+    slab_cache_t *	cache;
+    slab_t *		next;
+    slab_t *		prev;
+    int			n_free;
+    uint16_t		free[0];	/* stack of free object indices */
+};
+
+struct slab_cache_t
+{
+    const char *	name;
+    unsigned long	object_size;
+    int			n_objects;	/* per slab */
+
+    slab_t *		partial;	/* slabs with free objects */
+    slab_t *		full;
+    slab_t *		empty;		/* one spare, to avoid thrashing */
+
+    unsigned long	n_slabs;
+};
+
+typedef struct
+{
+    uint32_t		offset;		/* into the space, plus one; 0 if unused */
+    uint32_t		n_bytes;
+} size_entry_t;
+
 struct qxl_mem
 {
     mspace	space;
     void *	base;
     unsigned long n_bytes;
+
+    slab_cache_t	slabs[QXL_N_SLAB_TYPES];
+    slab_t **		slab_map;	/* indexed by slab_index () */
+    unsigned long	n_slab_map;
+
+    /* Sizes of live qxl_alloc () allocations, see record_size () */
+    size_entry_t *	sizes;
+    unsigned long	n_sizes;
+    unsigned long	n_size_slots;	/* a power of two, or 0 */
+
+    unsigned long	in_use;
+    unsigned long	high_water;
+    unsigned long	n_allocs;
+    unsigned long	n_frees;
+    unsigned long	n_failures;
+    unsigned long	n_retries;
+    unsigned long	size_classes[QXL_MEM_N_SIZE_CLASSES];
 };
 
+/* The size of each allocation is kept in host memory, in a hash table
+ * on its offset with linear probing, so that accounting for a free
+ * doesn't read the chunk header back from device memory.
+ */
+static unsigned long
+size_slot (struct qxl_mem *mem, uint32_t offset)
+{
+    return ((offset >> 3) * 2654435761U) & (mem->n_size_slots - 1);
+}
+
+static void
+insert_size (struct qxl_mem *mem, uint32_t offset, uint32_t n_bytes)
+{
+    unsigned long i = size_slot (mem, offset);
+
+    while (mem->sizes[i].offset)
+	i = (i + 1) & (mem->n_size_slots - 1);
+
+    mem->sizes[i].offset = offset;
+    mem->sizes[i].n_bytes = n_bytes;
+    mem->n_sizes++;
+}
+
+static void
+record_size (struct qxl_mem *mem, void *p, unsigned long n_bytes)
+{
+    if (2 * (mem->n_sizes + 1) > mem->n_size_slots)
+    {
+	size_entry_t *old = mem->sizes;
+	unsigned long n_old = mem->n_size_slots;
+	unsigned long n_new = n_old? 2 * n_old : 1024;
+	size_entry_t *new;
+	unsigned long i;
+
+	if (!(new = calloc (n_new, sizeof *new)))
+	    return;	/* The free will then count as 0 bytes */
+
+	mem->sizes = new;
+	mem->n_size_slots = n_new;
+	mem->n_sizes = 0;
+
+	for (i = 0; i < n_old; ++i)
+	{
+	    if (old[i].offset)
+		insert_size (mem, old[i].offset, old[i].n_bytes);
+	}
+
+	free (old);
+    }
+
+    insert_size (mem, (uint8_t *)p - (uint8_t *)mem->base + 1, n_bytes);
+}
+
+static unsigned long
+forget_size (struct qxl_mem *mem, void *p)
+{
+    uint32_t offset = (uint8_t *)p - (uint8_t *)mem->base + 1;
+    unsigned long mask = mem->n_size_slots - 1;
+    unsigned long i, j;
+    uint32_t n_bytes;
+
+    if (!mem->n_size_slots)
+	return 0;
+
+    for (i = size_slot (mem, offset); mem->sizes[i].offset != offset; i = (i + 1) & mask)
+    {
+	if (!mem->sizes[i].offset)
+	    return 0;
+    }
+
+    n_bytes = mem->sizes[i].n_bytes;
+    mem->n_sizes--;
+
+    /* Move later entries of the probe sequence back into the hole */
+    for (j = (i + 1) & mask; mem->sizes[j].offset; j = (j + 1) & mask)
+    {
+	unsigned long home = size_slot (mem, mem->sizes[j].offset);
+
+	if (((j - home) & mask) >= ((j - i) & mask))
+	{
+	    mem->sizes[i] = mem->sizes[j];
+	    i = j;
+	}
+    }
+
+    mem->sizes[i].offset = 0;
+
+    return n_bytes;
+}
+
+/* Telemetry is kept as allocations happen, so that reading it
+ * doesn't have to walk the heap, except for the free block figures
+ * that qxl_mem_get_stats () reports when asked to. Sizes are those
+ * asked for.
+ */
+static void
+account_alloc (struct qxl_mem *mem, void *p, unsigned long n_bytes)
+{
+    int class = 0;
+
+    if (!p)
+    {
+	mem->n_failures++;
+	return;
+    }
+
+    while (class < QXL_MEM_N_SIZE_CLASSES - 1 && (32UL << class) <= n_bytes)
+	class++;
+
+    mem->size_classes[class]++;
+    mem->n_allocs++;
+
+    mem->in_use += n_bytes;
+    if (mem->in_use > mem->high_water)
+	mem->high_water = mem->in_use;
+}
+
+static void
+account_free (struct qxl_mem *mem, unsigned long n_bytes)
+{
+    mem->n_frees++;
+    mem->in_use -= n_bytes;
+}
+
+static void
+init_slab_cache (slab_cache_t *cache, const char *name, unsigned long size)
+{
+    cache->name = name;
+    cache->object_size = (size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+    cache->n_objects = SLAB_SIZE / cache->object_size;
+    cache->partial = cache->full = cache->empty = NULL;
+    cache->n_slabs = 0;
+}
+
+static void
+init_slabs (struct qxl_mem *mem)
+{
+    init_slab_cache (&mem->slabs[QXL_SLAB_DRAWABLE],
+		     "drawable", sizeof (struct QXLDrawable));
+    init_slab_cache (&mem->slabs[QXL_SLAB_SURFACE_CMD],
+		     "surface cmd", sizeof (struct QXLSurfaceCmd));
+    init_slab_cache (&mem->slabs[QXL_SLAB_CURSOR_CMD],
+		     "cursor cmd", sizeof (struct QXLCursorCmd));
+    init_slab_cache (&mem->slabs[QXL_SLAB_IMAGE],
+		     "image", sizeof (struct QXLImage));
+}
+
+static void
+free_slab_headers (struct qxl_mem *mem)
+{
+    unsigned long i;
+
+    for (i = 0; i < mem->n_slab_map; ++i)
+    {
+	free (mem->slab_map[i]);
+	mem->slab_map[i] = NULL;
+    }
+}
+
 struct qxl_mem *
 qxl_mem_create       (void                   *base,
 		      unsigned long           n_bytes)
@@ -47,6 +273,17 @@ qxl_mem_create       (void                   *base,
     mem->base = base;
     mem->n_bytes = n_bytes;
 
+    mem->n_slab_map = n_bytes / SLAB_SIZE + 1;
+    mem->slab_map = calloc (mem->n_slab_map, sizeof (slab_t *));
+    if (!mem->slab_map)
+    {
+	free (mem);
+	mem = NULL;
+	goto out;
+    }
+
+    init_slabs (mem);
+
 out:
     return mem;
 
@@ -65,13 +302,22 @@ void *
 qxl_alloc            (struct qxl_mem         *mem,
 		      unsigned long           n_bytes)
 {
-    return mspace_malloc (mem->space, n_bytes);
+    void *p = mspace_malloc (mem->space, n_bytes);
+
+    account_alloc (mem, p, n_bytes);
+    if (p)
+	record_size (mem, p, n_bytes);
+
+    return p;
 }
 
 void
 qxl_free             (struct qxl_mem         *mem,
 		      void                   *d)
 {
+    if (d)
+	account_free (mem, forget_size (mem, d));
+
     mspace_free (mem->space, d);
 }
 
@@ -79,8 +325,377 @@ void
 qxl_mem_free_all     (struct qxl_mem         *mem)
 {
     mem->space = create_mspace_with_base (mem->base, mem->n_bytes, 0, NULL);
+    mem->in_use = 0;
+
+    if (mem->sizes)
+	memset (mem->sizes, 0, mem->n_size_slots * sizeof (size_entry_t));
+    mem->n_sizes = 0;
+
+    free_slab_headers (mem);
+    init_slabs (mem);
 }
 
+void
+qxl_mem_count_retry (struct qxl_mem *mem)
+{
+    mem->n_retries++;
+}
+
+/* The bytes an allocation really takes up, which can be more than
+ * was asked for. This reads the chunk header, so it is slow on
+ * device memory.
+ */
+unsigned long
+qxl_mem_usable_size (struct qxl_mem *mem, void *d)
+{
+    return mspace_usable_size (d);
+}
+
+/* Below an eighth of the space free, releases are collected as
+ * memory is allocated instead of waiting for the block handler
+ */
+Bool
+qxl_mem_is_low (struct qxl_mem *mem)
+{
+    return mem->in_use > mem->n_bytes - mem->n_bytes / 8;
+}
+
+/* The free block figures come from walking every chunk header, which
+ * on device memory means thousands of uncached reads, so they are
+ * only gathered if @walk is set and are 0 otherwise.
+ */
+void
+qxl_mem_get_stats (struct qxl_mem *mem, qxl_mem_stats_t *stats, Bool walk)
+{
+    size_t total = 0, largest = 0, n_blocks = 0;
+
+    if (walk)
+	mspace_free_stats (mem->space, &total, &largest, &n_blocks);
+
+    stats->n_bytes = mem->n_bytes;
+    stats->in_use = mem->in_use;
+    stats->high_water = mem->high_water;
+    stats->total_free = total;
+    stats->largest_free = largest;
+    stats->n_free_blocks = n_blocks;
+    stats->n_allocs = mem->n_allocs;
+    stats->n_frees = mem->n_frees;
+    stats->n_failures = mem->n_failures;
+    stats->n_retries = mem->n_retries;
+
+    memcpy (stats->size_classes, mem->size_classes, sizeof (mem->size_classes));
+}
+
+static unsigned long
+slab_index (struct qxl_mem *mem, const void *p)
+{
+    return ((uintptr_t)p / SLAB_SIZE) - ((uintptr_t)mem->base / SLAB_SIZE);
+}
+
+static void
+slab_unlink (slab_t **list, slab_t *slab)
+{
+    if (slab->prev)
+	slab->prev->next = slab->next;
+    else
+	*list = slab->next;
+
+    if (slab->next)
+	slab->next->prev = slab->prev;
+
+    slab->next = slab->prev = NULL;
+}
+
+static void
+slab_push (slab_t **list, slab_t *slab)
+{
+    slab->prev = NULL;
+    slab->next = *list;
+
+    if (*list)
+	(*list)->prev = slab;
+
+    *list = slab;
+}
+
+static slab_t *
+slab_create (struct qxl_mem *mem, slab_cache_t *cache)
+{
+    slab_t *slab;
+    uint8_t *base;
+    int i;
+
+    slab = malloc (sizeof *slab + cache->n_objects * sizeof (uint16_t));
+    if (!slab)
+	return NULL;
+
+    base = mspace_memalign (mem->space, SLAB_SIZE, SLAB_SIZE);
+
+    account_alloc (mem, base, SLAB_SIZE);
+
+    if (!base)
+    {
+	free (slab);
+	return NULL;
+    }
+
+    slab->base = base;
+    slab->cache = cache;
+    slab->next = slab->prev = NULL;
+    slab->n_free = cache->n_objects;
+
+    /* Hand out the lowest addresses first */
+    for (i = 0; i < cache->n_objects; ++i)
+	slab->free[i] = cache->n_objects - 1 - i;
+
+    mem->slab_map[slab_index (mem, base)] = slab;
+    cache->n_slabs++;
+
+    return slab;
+}
+
+static void
+slab_destroy (struct qxl_mem *mem, slab_t *slab)
+{
+    mem->slab_map[slab_index (mem, slab->base)] = NULL;
+    slab->cache->n_slabs--;
+
+    account_free (mem, SLAB_SIZE);
+    mspace_free (mem->space, slab->base);
+    free (slab);
+}
+
+void *
+qxl_slab_alloc (struct qxl_mem *mem, qxl_slab_type_t type)
+{
+    slab_cache_t *cache = &mem->slabs[type];
+    slab_t *slab = cache->partial;
+
+    if (!slab)
+    {
+	if ((slab = cache->empty))
+	    cache->empty = NULL;
+	else if (!(slab = slab_create (mem, cache)))
+	    return NULL;
+
+	slab_push (&cache->partial, slab);
+    }
+
+    if (--slab->n_free == 0)
+    {
+	slab_unlink (&cache->partial, slab);
+	slab_push (&cache->full, slab);
+    }
+
+    return slab->base + slab->free[slab->n_free] * cache->object_size;
+}
+
+void
+qxl_slab_free (struct qxl_mem *mem, void *d)
+{
+    slab_t *slab = mem->slab_map[slab_index (mem, d)];
+    slab_cache_t *cache = slab->cache;
+
+    slab->free[slab->n_free] = ((uint8_t *)d - slab->base) / cache->object_size;
+
+    if (slab->n_free++ == 0)
+    {
+	slab_unlink (&cache->full, slab);
+	slab_push (&cache->partial, slab);
+    }
+
+    if (slab->n_free == cache->n_objects)
+    {
+	slab_unlink (&cache->partial, slab);
+
+	if (cache->empty)
+	    slab_destroy (mem, slab);
+	else
+	    cache->empty = slab;
+    }
+}
+
+/* Copies into device memory. The PCI device maps RAM write-combined,
+ * so bulk data is written with aligned non-temporal stores that
+ * bypass the cache, followed by an sfence so the data is visible
+ * before any later doorbell or ring update. Many small copies, such
+ * as the lines of an image, use qxl_wc_memcpy_unfenced () and one
+ * qxl_wc_fence () at the end. XSpice and virtio device memory is
+ * ordinary RAM and just gets memcpy.
+ */
+#if defined(__x86_64__) && !defined XSPICE && !defined VIRTIO_QXL
+
+void
+qxl_wc_memcpy_unfenced (void *dest, const void *src, size_t n_bytes)
+{
+    uint8_t *d = dest;
+    const uint8_t *s = src;
+
+    if (n_bytes >= 64)
+    {
+	size_t head = (-(uintptr_t)d) & 15;
+
+	memcpy (d, s, head);
+	d += head;
+	s += head;
+	n_bytes -= head;
+
+	while (n_bytes >= 64)
+	{
+	    __m128i x0 = _mm_loadu_si128 ((const __m128i *)(s +  0));
+	    __m128i x1 = _mm_loadu_si128 ((const __m128i *)(s + 16));
+	    __m128i x2 = _mm_loadu_si128 ((const __m128i *)(s + 32));
+	    __m128i x3 = _mm_loadu_si128 ((const __m128i *)(s + 48));
+
+	    _mm_stream_si128 ((__m128i *)(d +  0), x0);
+	    _mm_stream_si128 ((__m128i *)(d + 16), x1);
+	    _mm_stream_si128 ((__m128i *)(d + 32), x2);
+	    _mm_stream_si128 ((__m128i *)(d + 48), x3);
+
+	    d += 64;
+	    s += 64;
+	    n_bytes -= 64;
+	}
+
+	while (n_bytes >= 16)
+	{
+	    _mm_stream_si128 ((__m128i *)d, _mm_loadu_si128 ((const __m128i *)s));
+
+	    d += 16;
+	    s += 16;
+	    n_bytes -= 16;
+	}
+    }
+
+    memcpy (d, s, n_bytes);
+}
+
+void
+qxl_wc_fence (void)
+{
+    _mm_sfence ();
+}
+
+void
+qxl_wc_memcpy (void *dest, const void *src, size_t n_bytes)
+{
+    qxl_wc_memcpy_unfenced (dest, src, n_bytes);
+    qxl_wc_fence ();
+}
+
+/* Ordinary loads from write-combined memory are not cached and go to
+ * the device one at a time. SSE4.1 streaming loads fetch a whole line
+ * into a streaming buffer, so reading a line in 16 byte pieces costs
+ * about one device access. On uncached memory, such as the VRAM BAR,
+ * they are ordinary loads. Compilers that can't
+ * build them for a CPU detected at runtime get plain memcpy.
+ */
+#ifdef HAVE_SSE41_STREAM_LOAD
+
+__attribute__((target ("sse4.1")))
+static void
+wc_read_sse41 (uint8_t *d, const uint8_t *s, size_t n_bytes)
+{
+    size_t head = (-(uintptr_t)s) & 15;
+
+    if (head > n_bytes)
+	head = n_bytes;
+
+    memcpy (d, s, head);
+    d += head;
+    s += head;
+    n_bytes -= head;
+
+    while (n_bytes >= 64)
+    {
+	__m128i x0 = _mm_stream_load_si128 ((__m128i *)(s +  0));
+	__m128i x1 = _mm_stream_load_si128 ((__m128i *)(s + 16));
+	__m128i x2 = _mm_stream_load_si128 ((__m128i *)(s + 32));
+	__m128i x3 = _mm_stream_load_si128 ((__m128i *)(s + 48));
+
+	_mm_storeu_si128 ((__m128i *)(d +  0), x0);
+	_mm_storeu_si128 ((__m128i *)(d + 16), x1);
+	_mm_storeu_si128 ((__m128i *)(d + 32), x2);
+	_mm_storeu_si128 ((__m128i *)(d + 48), x3);
+
+	d += 64;
+	s += 64;
+	n_bytes -= 64;
+    }
+
+    while (n_bytes >= 16)
+    {
+	_mm_storeu_si128 ((__m128i *)d, _mm_stream_load_si128 ((__m128i *)s));
+
+	d += 16;
+	s += 16;
+	n_bytes -= 16;
+    }
+
+    memcpy (d, s, n_bytes);
+}
+
+static void
+wc_read_plain (uint8_t *d, const uint8_t *s, size_t n_bytes)
+{
+    memcpy (d, s, n_bytes);
+}
+
+void
+qxl_wc_read (void *dest, const void *src, size_t n_bytes)
+{
+    static void (* read_func) (uint8_t *, const uint8_t *, size_t);
+
+    if (!read_func)
+    {
+	__builtin_cpu_init ();
+
+	if (__builtin_cpu_supports ("sse4.1"))
+	    read_func = wc_read_sse41;
+	else
+	    read_func = wc_read_plain;
+    }
+
+    read_func (dest, src, n_bytes);
+}
+
+#else
+
+void
+qxl_wc_read (void *dest, const void *src, size_t n_bytes)
+{
+    memcpy (dest, src, n_bytes);
+}
+
+#endif /* HAVE_SSE41_STREAM_LOAD */
+
+#else
+
+void
+qxl_wc_memcpy_unfenced (void *dest, const void *src, size_t n_bytes)
+{
+    memcpy (dest, src, n_bytes);
+}
+
+void
+qxl_wc_fence (void)
+{
+}
+
+void
+qxl_wc_memcpy (void *dest, const void *src, size_t n_bytes)
+{
+    memcpy (dest, src, n_bytes);
+}
+
+void
+qxl_wc_read (void *dest, const void *src, size_t n_bytes)
+{
+    memcpy (dest, src, n_bytes);
+}
+
+#endif
+
 #if 0
 
 #include <assert.h>
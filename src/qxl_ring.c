@@ -44,43 +44,102 @@ struct qxl_ring
     int			n_elements;
     int			io_port_prod_notify;
     qxl_screen_t    *qxl;
+
+    /* Elements queued by qxl_ring_queue() that have not
+     * been published to the device yet
+     */
+    uint8_t *		queue;
+    int			n_queued;
+
+    /* The device asked for a notification that has been deferred
+     * until the next qxl_ring_kick()
+     */
+    Bool		notify_pending;
+
+    qxl_waiter_t	waiter;		/* full ring stalls */
+
+    /* Statistics */
+    unsigned long	n_pushes;
+    unsigned long	n_pops;
+    unsigned long	n_notifies;
+    uint32_t		high_water;	/* largest prod - cons seen */
 };
 
 #ifdef VIRTIO_QXL
+/* The host only sees the parts of the rings that are pushed to it.
+ * prod and notify_on_cons are written by the producer, cons and
+ * notify_on_prod by the consumer, so each side only transfers its own
+ * words and the elements that changed. num_items never changes.
+ */
+#define PUSH_WORD(ring, field)						\
+    virtioqxl_push_ram ((ring)->qxl, (void *)&(ring)->ring->header.field,	\
+			sizeof (uint32_t))
+#define PULL_WORD(ring, field)						\
+    virtioqxl_pull_ram ((ring)->qxl, (void *)&(ring)->ring->header.field,	\
+			sizeof (uint32_t))
+
+static void ring_refresh (qxl_screen_t *qxl, void *data);
+
+static void
+virtio_sync_elements (struct qxl_ring *ring, uint32_t first, int n, Bool push)
+{
+    qxl_screen_t *qxl = ring->qxl;
+    uint8_t *elements = (uint8_t *)ring->ring->elements;
+    int idx = first & (ring->n_elements - 1);
+    int n_tail = ring->n_elements - idx;
+    int size = ring->element_size;
+
+    if (n > n_tail)
+    {
+	virtio_sync_elements (ring, first + n_tail, n - n_tail, push);
+	n = n_tail;
+    }
+
+    if (push)
+	virtioqxl_push_ram (qxl, elements + idx * size, n * size);
+    else
+	virtioqxl_pull_ram (qxl, elements + idx * size, n * size);
+}
+
+/* Producer side: send the elements in [first, first + n) and the new
+ * prod, and fetch the host's consumer position and the position it
+ * wants to be notified at. notify_on_prod and cons are adjacent.
+ */
 static void
-update_cursor_ring(qxl_screen_t *qxl) {
-    char *push1 = (char *)qxl->cursor_ring->ring;
-    char *pull = push1 + sizeof(uint32_t) * 3;
-    char *push2 = pull + sizeof(uint32_t);
-
-    virtioqxl_push_ram(qxl, (void *)push2,
-                       sizeof(QXLCursorRing) - sizeof(uint32_t) * 4);
-    virtioqxl_push_ram(qxl, (void *)push1, sizeof(uint32_t) * 3);
-    virtioqxl_pull_ram(qxl, (void *)pull, sizeof(uint32_t));
+virtio_push_ring (struct qxl_ring *ring, uint32_t first, int n)
+{
+    volatile struct qxl_ring_header *header = &(ring->ring->header);
+
+    virtio_sync_elements (ring, first, n, TRUE);
+    PUSH_WORD (ring, prod);
+    PUSH_WORD (ring, notify_on_cons);
+    virtioqxl_pull_ram (ring->qxl, (void *)&header->notify_on_prod,
+			2 * sizeof (uint32_t));
 }
 
+/* Producer side: after notify_on_cons was moved, send it and look at
+ * cons again, in case the host got there before it saw the request
+ */
 static void
-update_command_ring(qxl_screen_t *qxl) {
-    char *push1 = (char *)qxl->command_ring->ring;
-    char *pull = push1 + sizeof(uint32_t) * 3;
-    char *push2 = pull + sizeof(uint32_t);
-
-    virtioqxl_push_ram(qxl, (void *)push2,
-                       sizeof(QXLCommandRing) - sizeof(uint32_t) * 4);
-    virtioqxl_push_ram(qxl, (void *)push1, sizeof(uint32_t) * 3);
-    virtioqxl_pull_ram(qxl, (void *)pull, sizeof(uint32_t));
+virtio_arm_cons_notify (struct qxl_ring *ring)
+{
+    PUSH_WORD (ring, notify_on_cons);
+    PULL_WORD (ring, cons);
 }
 
+/* Consumer side: report how far we got, then fetch prod and the
+ * elements the host produced since then.
+ */
 static void
-update_release_ring(qxl_screen_t *qxl) {
-    char *pull1 = (char *)qxl->release_ring->ring;
-    char *push = pull1 + sizeof(uint32_t) * 3;
-    char *pull2 = push + sizeof(uint32_t);
-
-    virtioqxl_pull_ram(qxl, (void *)pull2,
-                       sizeof(QXLReleaseRing) - sizeof(uint32_t) * 4);
-    virtioqxl_pull_ram(qxl, (void *)pull1, sizeof(uint32_t) * 3);
-    virtioqxl_push_ram(qxl, (void *)push, sizeof(uint32_t));
+virtio_pull_ring (struct qxl_ring *ring)
+{
+    volatile struct qxl_ring_header *header = &(ring->ring->header);
+
+    PUSH_WORD (ring, cons);
+    PULL_WORD (ring, prod);
+
+    if (header->prod != header->cons)
+	virtio_sync_elements (ring, header->cons, header->prod - header->cons, FALSE);
 }
 #endif
 
@@ -98,6 +157,23 @@ qxl_ring_create (struct qxl_ring_header *header,
     if (!ring)
 	return NULL;
 
+    ring->queue = malloc (element_size * n_elements);
+    if (!ring->queue)
+    {
+	free (ring);
+	return NULL;
+    }
+    ring->n_queued = 0;
+    ring->notify_pending = FALSE;
+    qxl_waiter_init (&ring->waiter);
+#ifdef VIRTIO_QXL
+    ring->waiter.refresh = ring_refresh;
+#endif
+    ring->n_pushes = 0;
+    ring->n_pops = 0;
+    ring->n_notifies = 0;
+    ring->high_water = 0;
+
     if(strcmp(label,"command") == 0)
         ring->type = COMMAND_RING;
     if(strcmp(label,"cursor") == 0)
@@ -115,8 +191,87 @@ qxl_ring_create (struct qxl_ring_header *header,
 }
 
 #ifdef VIRTIO_QXL
+/* Memory referenced by a batch of commands is collected into a list of
+ * areas, which are merged where they touch before being pushed to the
+ * host. That takes one PUSH_AREA ioctl per merged area instead of one
+ * per drawable, image, chunk and cursor shape.
+ */
+#define MAX_RAM_AREAS 64
+
+struct ram_area_list
+{
+    int n_areas;
+    struct qxl_ram_area areas[MAX_RAM_AREAS];
+};
+
+static int
+compare_areas (const void *a, const void *b)
+{
+    const struct qxl_ram_area *area_a = a;
+    const struct qxl_ram_area *area_b = b;
+
+    if (area_a->offset < area_b->offset)
+        return -1;
+    return area_a->offset > area_b->offset;
+}
+
+static void
+ram_area_list_flush (qxl_screen_t *qxl, struct ram_area_list *list)
+{
+    struct qxl_ram_area *areas = list->areas;
+    int i, n;
+
+    if (list->n_areas == 0)
+        return;
+
+    /* Allocations for one command are often adjacent in command RAM,
+     * so sorting lets most of them merge into a few larger areas.
+     */
+    qsort (areas, list->n_areas, sizeof (*areas), compare_areas);
+
+    n = 0;
+    for (i = 1; i < list->n_areas; ++i) {
+        struct qxl_ram_area *last = &areas[n];
+        uint32_t last_end = last->offset + last->len;
+
+        if (areas[i].offset <= last_end) {
+            uint32_t end = areas[i].offset + areas[i].len;
+
+            if (end > last_end)
+                last->len = end - last->offset;
+        } else {
+            areas[++n] = areas[i];
+        }
+    }
+    n++;
+
+    for (i = 0; i < n; ++i)
+        ioctl(qxl->virtiofd, QXL_IOCTL_QXL_IO_PUSH_AREA, &areas[i]);
+
+    list->n_areas = 0;
+}
+
+static void
+ram_area_list_add (qxl_screen_t *qxl, struct ram_area_list *list,
+                   void *ptr, int len)
+{
+    char *start = ptr;
+    struct qxl_ram_area *area;
+
+    if (!virtioqxl_push_in_bounds (qxl, __func__, ptr, len))
+        return;
+
+    if (list->n_areas == MAX_RAM_AREAS)
+        ram_area_list_flush (qxl, list);
+
+    area = &list->areas[list->n_areas++];
+    area->offset = start - (char *)qxl->ram;
+    area->len = len;
+}
+
 static void
-qxl_ring_push_command(struct qxl_ring *ring, struct QXLCommand *cmd)
+qxl_ring_push_command(struct qxl_ring *ring, struct QXLCommand *cmd,
+                      struct ram_area_list *list)
 {
     qxl_screen_t *qxl = ring->qxl;
 
@@ -129,7 +284,7 @@ qxl_ring_push_command(struct qxl_ring *ring, struct QXLCommand *cmd)
             QXLSurfaceCmd *c = virtual_address(qxl, (void *)cmd->data,
                                                qxl->main_mem_slot);
 
-            virtioqxl_push_ram(qxl, (void *)c, sizeof(*c));
+            ram_area_list_add(qxl, list, (void *)c, sizeof(*c));
 
             if (c->type == QXL_SURFACE_CMD_DESTROY) {
                 break;
@@ -138,8 +293,8 @@ qxl_ring_push_command(struct qxl_ring *ring, struct QXLCommand *cmd)
             surf = c->u.surface_create;
             stride = abs(surf.stride);
             ptr = virtual_address(qxl, (void *)surf.data, qxl->vram_mem_slot);
-            virtioqxl_push_ram(qxl, (void *)ptr,
-                               surf.height * stride + stride);
+            ram_area_list_add(qxl, list, (void *)ptr,
+                              surf.height * stride + stride);
             break;
         }
         case QXL_CMD_DRAW:
@@ -150,7 +305,7 @@ qxl_ring_push_command(struct qxl_ring *ring, struct QXLCommand *cmd)
             QXLDrawable *draw = virtual_address(qxl, (void *)cmd->data,
                                                 qxl->main_mem_slot);
 
-            virtioqxl_push_ram(qxl, (void *)draw, sizeof(*draw));
+            ram_area_list_add(qxl, list, (void *)draw, sizeof(*draw));
 
             if (draw->type != QXL_DRAW_COPY) {
                 break;
@@ -158,7 +313,7 @@ qxl_ring_push_command(struct qxl_ring *ring, struct QXLCommand *cmd)
 
             image = virtual_address(qxl, (void *)draw->u.copy.src_bitmap,
                                     qxl->main_mem_slot);
-            virtioqxl_push_ram(qxl, (void *)image, sizeof(*image));
+            ram_area_list_add(qxl, list, (void *)image, sizeof(*image));
 
             if (image->descriptor.type == SPICE_IMAGE_TYPE_SURFACE) {
                 break;
@@ -167,15 +322,23 @@ qxl_ring_push_command(struct qxl_ring *ring, struct QXLCommand *cmd)
             if (image->bitmap.flags & QXL_BITMAP_DIRECT) {
                 uint8_t *ptr = virtual_address(qxl, (void *)image->bitmap.data,
                                                qxl->main_mem_slot);
-                virtioqxl_push_ram(qxl, (void *)ptr,
+                ram_area_list_add(qxl, list, (void *)ptr,
                         image->descriptor.height * image->bitmap.stride);
                 break;
             }
+            if (image->bitmap.palette) {
+                QXLPalette *palette = virtual_address(qxl,
+                                                      (void *)image->bitmap.palette,
+                                                      qxl->main_mem_slot);
+                ram_area_list_add(qxl, list, (void *)palette,
+                                  sizeof(*palette) +
+                                  palette->num_ents * sizeof(uint32_t));
+            }
             addr = image->bitmap.data;
             while (addr) {
                 chunk = virtual_address(qxl, (void *)addr, qxl->main_mem_slot);
-                virtioqxl_push_ram(qxl, (void *)chunk,
-                                   sizeof(*chunk) + chunk->data_size);
+                ram_area_list_add(qxl, list, (void *)chunk,
+                                  sizeof(*chunk) + chunk->data_size);
                 addr = chunk->next_chunk;
             }
             break;
@@ -186,7 +349,7 @@ qxl_ring_push_command(struct qxl_ring *ring, struct QXLCommand *cmd)
             QXLCursorCmd *c = virtual_address(qxl, (void *)cmd->data,
                                               qxl->main_mem_slot);
 
-            virtioqxl_push_ram(qxl, (void *)c, sizeof(*c));
+            ram_area_list_add(qxl, list, (void *)c, sizeof(*c));
 
             if (c->type != QXL_CURSOR_SET) {
                 break;
@@ -194,29 +357,86 @@ qxl_ring_push_command(struct qxl_ring *ring, struct QXLCommand *cmd)
 
             cursor = virtual_address(qxl, (void *)c->u.set.shape,
                                      qxl->main_mem_slot);
-            virtioqxl_push_ram(qxl, (void *)cursor,
-                               sizeof(*cursor) + cursor->data_size);
+            ram_area_list_add(qxl, list, (void *)cursor,
+                              sizeof(*cursor) + cursor->data_size);
             break;
         }
     }
 }
 #endif // VIRTIO_QXL
 
-void
-qxl_ring_push (struct qxl_ring *ring,
-	       const void      *new_elt)
+static Bool
+ring_has_space (qxl_screen_t *qxl, void *data)
 {
+    struct qxl_ring *ring = data;
     volatile struct qxl_ring_header *header = &(ring->ring->header);
-    volatile uint8_t *elt;
-    int idx;
-    struct QXLCommand *cmd = (QXLCommand *)new_elt;
-    struct QXLRam *ram = get_ram_header(ring->qxl);
 
-#ifdef DEBUG_LOG_COMMAND
-    qxl_log_command(ring->qxl, cmd, "");
+    if (header->prod - header->cons != header->num_items)
+	return TRUE;
+
+    /* The consumer may be asleep waiting for a deferred notification */
+    qxl_ring_kick (ring);
+
+    /* in gtkperf, circles, this is a major bottleneck. Ask the
+     * consumer to tell us when it pops the next element, so that
+     * the wait can sleep instead of spinning.
+     */
+    header->notify_on_cons = header->cons + 1;
+    mem_barrier();
+
+    return header->prod - header->cons != header->num_items;
+}
+
+static Bool
+ring_is_idle (qxl_screen_t *qxl, void *data)
+{
+    struct qxl_ring *ring = data;
+    volatile struct qxl_ring_header *header = &(ring->ring->header);
+
+    if (header->cons == header->prod)
+	return TRUE;
+
+    qxl_ring_kick (ring);
+
+    header->notify_on_cons = header->prod;
+    mem_barrier();
+
+    return header->cons == header->prod;
+}
+
+#ifdef VIRTIO_QXL
+/* The waits above only look at local state. Once per backoff step, wake
+ * the host and exchange the notification request and cons with it.
+ */
+static void
+ring_refresh (qxl_screen_t *qxl, void *data)
+{
+    struct qxl_ring *ring = data;
+
+    ioport_write (qxl, ring->io_port_prod_notify, 0);
+    virtio_arm_cons_notify (ring);
+}
 #endif
 
+/* Publish @n_elements elements to the device. As many elements as
+ * there is room for are copied into the ring, and then 'prod' is
+ * advanced once for all of them, so the device is notified at most
+ * once per batch instead of once per element.
+ */
+void
+qxl_ring_push_many (struct qxl_ring *ring,
+		    const void      *elements,
+		    int              n_elements)
+{
+    volatile struct qxl_ring_header *header = &(ring->ring->header);
+    const uint8_t *src = elements;
+
 #ifdef VIRTIO_QXL
+    struct QXLRam *ram = get_ram_header(ring->qxl);
+    struct ram_area_list areas;
+
+    areas.n_areas = 0;
+
     if(ring->type == CURSOR_RING){
         // When the guest stop sending cursor commands, the host side
         // consumer(libspice thread) sleeps. This avoid a delay when starting
@@ -225,42 +445,143 @@ qxl_ring_push (struct qxl_ring *ring,
             ioport_write(ring->qxl, QXL_IO_NOTIFY_CURSOR, 0);
         }
     }
-    qxl_ring_push_command(ring, cmd);
 #endif
 
-    while (header->prod - header->cons == header->num_items)
+    while (n_elements > 0)
     {
+	uint32_t prod;
+	int n_free, n, i;
+
+	qxl_wait (ring->qxl, &ring->waiter, ring_has_space, ring);
+
+	prod = header->prod;
+	n_free = header->num_items - (prod - header->cons);
+
+	n = n_elements < n_free ? n_elements : n_free;
+
+#if defined DEBUG_LOG_COMMAND || defined VIRTIO_QXL
+	for (i = 0; i < n; ++i)
+	{
+	    const uint8_t *new_elt = src + i * ring->element_size;
+
+#ifdef DEBUG_LOG_COMMAND
+	    qxl_log_command(ring->qxl, (QXLCommand *)new_elt, "");
+#endif
 #ifdef VIRTIO_QXL
-        ioport_write(ring->qxl, QXL_IO_NOTIFY_CURSOR, 0);
-        update_command_ring(ring->qxl);
-        update_cursor_ring(ring->qxl);
-        sched_yield();
+	    qxl_ring_push_command(ring, (QXLCommand *)new_elt, &areas);
 #endif
-        header->notify_on_cons = header->cons + 1;
-#ifdef XSPICE
-	/* in gtkperf, circles, this is a major bottleneck. Can't be that good in a vm either
-	 * Adding the yield reduces cpu usage, but doesn't improve throughput. */
-        sched_yield();
+	}
 #endif
-	mem_barrier();
-    }
 
-    idx = header->prod & (ring->n_elements - 1);
-    elt = ring->ring->elements + idx * ring->element_size;
+	/* At most two contiguous runs, one on each side of the wrap */
+	for (i = 0; i < n; )
+	{
+	    int idx = (prod + i) & (ring->n_elements - 1);
+	    int run = ring->n_elements - idx;
 
-    memcpy((void *)elt, new_elt, ring->element_size);
+	    if (run > n - i)
+		run = n - i;
 
-    header->prod++;
+	    qxl_wc_memcpy_unfenced (
+		(void *)(ring->ring->elements + idx * ring->element_size),
+		src + i * ring->element_size, run * ring->element_size);
 
-    mem_barrier();
+	    i += run;
+	}
+
+	qxl_wc_fence ();
 
 #ifdef VIRTIO_QXL
-    update_command_ring(ring->qxl);
-    update_cursor_ring(ring->qxl);
+	/* The host must have everything the commands refer to
+	 * before it can see them in the ring
+	 */
+	ram_area_list_flush (ring->qxl, &areas);
 #endif
 
-    if (header->prod == header->notify_on_prod) {
-        ioport_write (ring->qxl, ring->io_port_prod_notify, 0);
+	header->prod = prod + n;
+
+	mem_barrier();
+
+	ring->n_pushes += n;
+	if (prod + n - header->cons > ring->high_water)
+	    ring->high_water = prod + n - header->cons;
+
+#ifdef VIRTIO_QXL
+	virtio_push_ring (ring, prod, n);
+#endif
+
+	/* The device wants a notification when 'prod' reaches
+	 * notify_on_prod; ring once if that position is among
+	 * the ones published above.
+	 */
+	if ((uint32_t)(header->notify_on_prod - prod - 1) < (uint32_t)n)
+	    ring->notify_pending = TRUE;
+
+	/* In deferred mode the notification waits for the block
+	 * handler, unless the ring is filling up.
+	 */
+	if (!ring->qxl->defer_notify ||
+	    prod + n - header->cons >= header->num_items / 2)
+	{
+	    qxl_ring_kick (ring);
+	}
+
+	src += n * ring->element_size;
+	n_elements -= n;
+    }
+}
+
+/* Send a notification that was deferred by qxl_ring_push_many() */
+void
+qxl_ring_kick (struct qxl_ring *ring)
+{
+    if (ring->notify_pending)
+    {
+	ring->notify_pending = FALSE;
+
+	ioport_write (ring->qxl, ring->io_port_prod_notify, 0);
+	ring->n_notifies++;
+    }
+}
+
+void
+qxl_ring_push (struct qxl_ring *ring,
+	       const void      *new_elt)
+{
+    /* Anything queued must reach the device first */
+    qxl_ring_flush (ring);
+
+    qxl_ring_push_many (ring, new_elt, 1);
+}
+
+/* Add an element to the ring's command queue. Queued elements are
+ * published together by qxl_ring_flush(), which happens from the
+ * block handler, before the driver waits for the device, and
+ * whenever the queue holds a full ring's worth of elements.
+ */
+void
+qxl_ring_queue (struct qxl_ring *ring,
+		const void      *new_elt)
+{
+    if (ring->n_queued == ring->n_elements)
+	qxl_ring_flush (ring);
+
+    memcpy (ring->queue + ring->n_queued * ring->element_size,
+	    new_elt, ring->element_size);
+
+    ring->n_queued++;
+}
+
+void
+qxl_ring_flush (struct qxl_ring *ring)
+{
+    int n_queued = ring->n_queued;
+
+    if (n_queued)
+    {
+	ring->n_queued = 0;
+
+	qxl_ring_push_many (ring, ring->queue, n_queued);
     }
 }
 
@@ -273,12 +594,17 @@ qxl_ring_pop (struct qxl_ring *ring,
     int idx;
 
 #ifdef VIRTIO_QXL
-    update_release_ring(ring->qxl);
+    /* Only go to the host once everything fetched so far is used up */
+    if (header->cons == header->prod)
+	virtio_pull_ring (ring);
 #endif
 
     if (header->cons == header->prod)
 	return FALSE;
 
+    if (header->prod - header->cons > ring->high_water)
+	ring->high_water = header->prod - header->cons;
+
     idx = header->cons & (ring->n_elements - 1);
     ring_elt = ring->ring->elements + idx * ring->element_size;
 
@@ -286,15 +612,34 @@ qxl_ring_pop (struct qxl_ring *ring,
 
     header->cons++;
 
+    ring->n_pops++;
+
     return TRUE;
 }
 
 void
 qxl_ring_wait_idle (struct qxl_ring *ring)
 {
-    while (ring->ring->header.cons != ring->ring->header.prod)
-    {
-	usleep (1000);
-	mem_barrier();
-    }
+    qxl_waiter_t waiter;
+
+    qxl_ring_flush (ring);
+
+    qxl_waiter_init (&waiter);
+#ifdef VIRTIO_QXL
+    waiter.refresh = ring_refresh;
+#endif
+    qxl_wait (ring->qxl, &waiter, ring_is_idle, ring);
+}
+
+void
+qxl_ring_dump_stats (struct qxl_ring *ring)
+{
+    xf86DrvMsg (ring->qxl->pScrn->scrnIndex, X_INFO,
+		"%s ring: %lu pushes, %lu pops, %lu notifies, "
+		"%lu stalls (%llu us, max %llu us), high water %u/%d\n",
+		ring->label, ring->n_pushes, ring->n_pops, ring->n_notifies,
+		ring->waiter.n_waits,
+		(unsigned long long)ring->waiter.total_us,
+		(unsigned long long)ring->waiter.max_us,
+		ring->high_water, ring->n_elements);
 }
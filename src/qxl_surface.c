@@ -44,6 +44,7 @@
  *
  */
 #include "qxl.h"
+#include "murmurhash3.h"
 
 typedef struct evacuated_surface_t evacuated_surface_t;
 
@@ -56,7 +57,25 @@ struct evacuated_surface_t
     evacuated_surface_t *next;
 };
 
-#define N_CACHED_SURFACES 64
+/* Dead surfaces are kept for reuse in buckets by bpp and size class.
+ * Size classes go up in half octaves: 128, 192, 256, 384, ... 32768.
+ * A surface goes in the largest class its size reaches, and serves
+ * requests in that class, so it always fits and is less than twice
+ * the requested size in each dimension.
+ */
+#define N_CACHED_SURFACES	64
+#define MIN_CACHED_SIZE		128
+#define N_SIZE_CLASSES		17
+#define N_BPP_CLASSES		3
+#define N_BUCKETS		(N_BPP_CLASSES * N_SIZE_CLASSES * N_SIZE_CLASSES)
+
+/* Fraction of video memory that cached surfaces may use */
+#define CACHE_VRAM_FRACTION	4
+
+#define CELL_WIDTH 64
+
+#define MAX(a,b)  (((a) > (b))? (a) : (b))
+#define MIN(a,b)  (((a) < (b))? (a) : (b))
 
 /*
  * Surface cache
@@ -77,11 +96,30 @@ struct surface_cache_t
     qxl_surface_t *free_surfaces;
 
     /* Surfaces that are already allocated, but not in used by the driver,
-     * linked through next
+     * linked through next/prev in their bucket, and through
+     * lru_next/lru_prev from the most recently cached
      */
-    qxl_surface_t *cached_surfaces[N_CACHED_SURFACES];
+    qxl_surface_t *buckets[N_BUCKETS];
+    qxl_surface_t *lru_head;
+    qxl_surface_t *lru_tail;
+    int n_cached;
+    unsigned long cached_bytes;
+    unsigned long max_cached_bytes;
+
+    unsigned long n_hits;
+    unsigned long n_misses;
+    unsigned long n_evictions;
+    unsigned long wasted_bytes;		/* unused parts of surfaces handed out */
+
+    /* Set while compact_vram () relocates surfaces */
+    Bool compacting;
+
+    /* Shared surfaces for small pixmaps */
+    atlas_t *atlases;
 };
 
+static Bool compact_vram (surface_cache_t *cache, unsigned long n_bytes);
+
 static Bool
 surface_cache_init (surface_cache_t *cache, qxl_screen_t *qxl)
 {
@@ -93,10 +131,17 @@ surface_cache_init (surface_cache_t *cache, qxl_screen_t *qxl)
 	return FALSE;
 
     memset (cache->all_surfaces, 0, n_surfaces * sizeof (qxl_surface_t));
-    memset (cache->cached_surfaces, 0, N_CACHED_SURFACES * sizeof (qxl_surface_t *));
+    memset (cache->buckets, 0, N_BUCKETS * sizeof (qxl_surface_t *));
+    cache->lru_head = NULL;
+    cache->lru_tail = NULL;
+    cache->n_cached = 0;
+    cache->cached_bytes = 0;
+    cache->max_cached_bytes = qxl->vram_size / CACHE_VRAM_FRACTION;
     
     cache->free_surfaces = NULL;
     cache->live_surfaces = NULL;
+    cache->compacting = FALSE;
+    cache->atlases = NULL;
     
     for (i = 0; i < n_surfaces; ++i)
     {
@@ -104,6 +149,7 @@ surface_cache_init (surface_cache_t *cache, qxl_screen_t *qxl)
 	cache->all_surfaces[i].cache = cache;
 	cache->all_surfaces[i].dev_image = NULL;
 	cache->all_surfaces[i].host_image = NULL;
+	cache->all_surfaces[i].bucket = -1;
 	
 	REGION_INIT (
 	    NULL, &(cache->all_surfaces[i].access_region), (BoxPtr)NULL, 0);
@@ -129,6 +175,11 @@ qxl_surface_cache_create (qxl_screen_t *qxl)
 	return NULL;
 
     cache->qxl = qxl;
+    cache->n_hits = 0;
+    cache->n_misses = 0;
+    cache->n_evictions = 0;
+    cache->wasted_bytes = 0;
+
     if (!surface_cache_init (cache, qxl))
     {
 	free (cache);
@@ -177,22 +228,37 @@ qxl_surface_free_all (qxl_screen_t *qxl)
 static void
 print_cache_info (surface_cache_t *cache)
 {
-    int i;
-    int n_surfaces = 0;
+    qxl_surface_t *s;
 
     ErrorF ("Cache contents:  ");
-    for (i = 0; i < N_CACHED_SURFACES; ++i)
+    for (s = cache->lru_head; s; s = s->lru_next)
     {
-	if (cache->cached_surfaces[i])
-	{
-	    ErrorF ("%4d ", cache->cached_surfaces[i]->id);
-	    n_surfaces++;
-	}
-	else
-	    ErrorF ("null ");
+	ErrorF ("%4d (%dx%d) ", s->id,
+		pixman_image_get_width (s->host_image),
+		pixman_image_get_height (s->host_image));
     }
 
-    ErrorF ("    total: %d\n", n_surfaces);
+    ErrorF ("    total: %d, %lu KB\n", cache->n_cached, cache->cached_bytes / 1024);
+}
+
+void
+qxl_surface_cache_dump_stats (surface_cache_t *cache)
+{
+    unsigned long n_lookups;
+
+    if (!cache)
+	return;
+
+    n_lookups = cache->n_hits + cache->n_misses;
+
+    xf86DrvMsg (cache->qxl->pScrn->scrnIndex, X_INFO,
+		"Surface cache: %d surfaces, %lu/%lu KB, "
+		"%lu hits, %lu misses (%lu%%), %lu evictions, %lu KB wasted\n",
+		cache->n_cached,
+		cache->cached_bytes / 1024, cache->max_cached_bytes / 1024,
+		cache->n_hits, cache->n_misses,
+		n_lookups? cache->n_hits * 100 / n_lookups : 0,
+		cache->n_evictions, cache->wasted_bytes / 1024);
 }
 
 static void
@@ -226,56 +292,129 @@ get_formats (int bpp, SpiceBitmapFmt *format, pixman_format_code_t *pformat)
     }
 }
 		 
-static qxl_surface_t *
-surface_get_from_cache (surface_cache_t *cache, int width, int height, int bpp)
+static int
+class_bound (int c)
 {
-    int i;
+    return (c & 1)? 3 << (c / 2 + 6) : 1 << (c / 2 + 7);
+}
 
-#if 0
-    ErrorF ("Before getting from cache\n");
-    print_cache_info (cache);
-#endif
+/* The largest class whose requests a surface of this size can serve */
+static int
+class_of_surface (int size)
+{
+    int c;
 
-    for (i = 0; i < N_CACHED_SURFACES; ++i)
+    for (c = N_SIZE_CLASSES - 1; c >= 0; --c)
     {
-	qxl_surface_t *s = cache->cached_surfaces[i];
+	if (class_bound (c) <= size)
+	    return c;
+    }
 
-	if (s && bpp == s->bpp)
-	{
-	    int w = pixman_image_get_width (s->host_image);
-	    int h = pixman_image_get_height (s->host_image);
-	    
-	    if (width <= w && width * 4 > w && height <= h && height * 4 > h)
-	    {
-		cache->cached_surfaces[i] = NULL;
+    return -1;
+}
 
-#if 0
-		ErrorF ("Got %d from cache\n", s->id);
-		print_cache_info (cache);
-#endif
-		return s;
-	    }
-	}
-#if 0
-	else
-	{
-	    if (s)
-		ErrorF ("!%d (%d %d %d, %d); ", s->id,
-			pixman_image_get_width (s->host_image),
-			pixman_image_get_height (s->host_image),
-			bpp,
-			s->bpp);
-	    else
-		ErrorF ("[null]; ");
-	}
-#endif
+/* The smallest class that fits a request. Requests too small for
+ * the first class to fit within a factor of two are not served.
+ */
+static int
+class_of_request (int size)
+{
+    int c;
+
+    if (size * 4 < class_bound (0) * 3)
+	return -1;
+
+    for (c = 0; c < N_SIZE_CLASSES; ++c)
+    {
+	if (class_bound (c) >= size)
+	    return c;
+    }
+
+    return -1;
+}
+
+static int
+bucket_index (int bpp, int wclass, int hclass)
+{
+    int b;
+
+    switch (bpp)
+    {
+    case 16: b = 0; break;
+    case 24: b = 1; break;
+    case 32: b = 2; break;
+    default: return -1;
+    }
+
+    if (wclass < 0 || hclass < 0)
+	return -1;
+
+    return (b * N_SIZE_CLASSES + wclass) * N_SIZE_CLASSES + hclass;
+}
+
+static unsigned long
+surface_bytes (qxl_surface_t *surface)
+{
+    return (unsigned long)pixman_image_get_height (surface->dev_image) *
+	-pixman_image_get_stride (surface->dev_image);
+}
+
+static void
+cache_remove (surface_cache_t *cache, qxl_surface_t *surface)
+{
+    if (surface->prev)
+	surface->prev->next = surface->next;
+    else
+	cache->buckets[surface->bucket] = surface->next;
+    if (surface->next)
+	surface->next->prev = surface->prev;
+
+    if (surface->lru_prev)
+	surface->lru_prev->lru_next = surface->lru_next;
+    else
+	cache->lru_head = surface->lru_next;
+    if (surface->lru_next)
+	surface->lru_next->lru_prev = surface->lru_prev;
+    else
+	cache->lru_tail = surface->lru_prev;
+
+    surface->next = surface->prev = NULL;
+    surface->lru_next = surface->lru_prev = NULL;
+    surface->bucket = -1;
+
+    cache->n_cached--;
+    cache->cached_bytes -= surface_bytes (surface);
+}
+
+static qxl_surface_t *
+surface_get_from_cache (surface_cache_t *cache, int width, int height, int bpp)
+{
+    int bucket = bucket_index (
+	bpp, class_of_request (width), class_of_request (height));
+    qxl_surface_t *s;
+    int w, h;
+
+    if (bucket < 0 || !(s = cache->buckets[bucket]))
+    {
+	cache->n_misses++;
+	return NULL;
     }
 
+    cache_remove (cache, s);
+
+    w = pixman_image_get_width (s->host_image);
+    h = pixman_image_get_height (s->host_image);
+
+    cache->n_hits++;
+    cache->wasted_bytes += surface_bytes (s) -
+	surface_bytes (s) / h * height / w * width;
+
 #if 0
-    ErrorF ("Nothing in cache for %d %d %d\n", width, height, bpp);
+    ErrorF ("Got %d from cache\n", s->id);
+    print_cache_info (cache);
 #endif
-    
-    return NULL;
+
+    return s;
 }
 
 static int n_live;
@@ -368,6 +507,12 @@ qxl_surface_cache_create_primary (surface_cache_t	*cache,
     surface->bpp = mode->bits;
     surface->next = NULL;
     surface->prev = NULL;
+    surface->line_hashes = NULL;
+    surface->n_cells = 0;
+    surface->bucket = -1;
+    surface->atlas = NULL;
+    surface->atlas_x = 0;
+    surface->atlas_y = 0;
 
 #if 0
     ErrorF ("primary %p\n", surface->address);
@@ -385,9 +530,7 @@ make_surface_cmd (surface_cache_t *cache, uint32_t id, QXLSurfaceCmdType type)
     struct QXLSurfaceCmd *cmd;
     qxl_screen_t *qxl = cache->qxl;
 
-    qxl_garbage_collect (qxl);
-    
-    cmd = qxl_allocnf (qxl, sizeof *cmd);
+    cmd = qxl_slab_allocnf (qxl, QXL_SLAB_SURFACE_CMD);
 
     cmd->release_info.id = pointer_to_u64 (cmd) | 2;
     cmd->type = type;
@@ -406,7 +549,7 @@ push_surface_cmd (surface_cache_t *cache, struct QXLSurfaceCmd *cmd)
     command.type = QXL_CMD_SURFACE;
     command.data = physical_address (qxl, cmd, qxl->main_mem_slot);
     
-    qxl_ring_push (qxl->command_ring, &command);
+    qxl_ring_queue (qxl->command_ring, &command);
 }
 
 enum ROPDescriptor
@@ -425,20 +568,21 @@ enum ROPDescriptor
 };
 
 static struct QXLDrawable *
-make_drawable (qxl_screen_t *qxl, int surface, uint8_t type,
+make_drawable (qxl_screen_t *qxl, qxl_surface_t *surface, uint8_t type,
 	       const struct QXLRect *rect
 	       /* , pRegion clip */)
 {
     struct QXLDrawable *drawable;
     int i;
     
-    drawable = qxl_allocnf (qxl, sizeof *drawable);
+    drawable = qxl_slab_allocnf (qxl, QXL_SLAB_DRAWABLE);
     
     drawable->release_info.id = pointer_to_u64 (drawable);
     
     drawable->type = type;
     
-    drawable->surface_id = surface;		/* Only primary for now */
+    drawable->surface_id = surface->id;
+
     drawable->effect = QXL_EFFECT_OPAQUE;
     drawable->self_bitmap = 0;
     drawable->self_bitmap_area.top = 0;
@@ -457,8 +601,14 @@ make_drawable (qxl_screen_t *qxl, int surface, uint8_t type,
     for (i = 0; i < 3; ++i)
 	drawable->surfaces_dest[i] = -1;
     
+    /* Atlas slots draw at their position in the atlas */
     if (rect)
-	drawable->bbox = *rect;
+    {
+	drawable->bbox.left = rect->left + surface->atlas_x;
+	drawable->bbox.right = rect->right + surface->atlas_x;
+	drawable->bbox.top = rect->top + surface->atlas_y;
+	drawable->bbox.bottom = rect->bottom + surface->atlas_y;
+    }
     
     drawable->mm_time = qxl->rom->mm_clock;
     
@@ -466,7 +616,8 @@ make_drawable (qxl_screen_t *qxl, int surface, uint8_t type,
 }
 
 static void
-push_drawable (qxl_screen_t *qxl, struct QXLDrawable *drawable)
+push_drawable (qxl_screen_t *qxl, qxl_surface_t *surface,
+	       struct QXLDrawable *drawable)
 {
     struct QXLCommand cmd;
     
@@ -484,17 +635,23 @@ push_drawable (qxl_screen_t *qxl, struct QXLDrawable *drawable)
 	cmd.type = QXL_CMD_DRAW;
 	cmd.data = physical_address (qxl, drawable, qxl->main_mem_slot);
 	
-	qxl_ring_push (qxl->command_ring, &cmd);
+	qxl_ring_queue (qxl->command_ring, &cmd);
+
+	/* Only drawables the device gets are ever released. The
+	 * surface is passed in to avoid reading the id back from
+	 * device memory.
+	 */
+	qxl->surface_cache->all_surfaces[surface->id].n_pending++;
     }
 }
 
 static void
-submit_fill (qxl_screen_t *qxl, int id,
+submit_fill (qxl_screen_t *qxl, qxl_surface_t *surface,
 	     const struct QXLRect *rect, uint32_t color)
 {
     struct QXLDrawable *drawable;
     
-    drawable = make_drawable (qxl, id, QXL_DRAW_FILL, rect);
+    drawable = make_drawable (qxl, surface, QXL_DRAW_FILL, rect);
     
     drawable->u.fill.brush.type = SPICE_BRUSH_TYPE_SOLID;
     drawable->u.fill.brush.u.color = color;
@@ -504,7 +661,27 @@ submit_fill (qxl_screen_t *qxl, int id,
     drawable->u.fill.mask.pos.y = 0;
     drawable->u.fill.mask.bitmap = 0;
     
-    push_drawable (qxl, drawable);
+    push_drawable (qxl, surface, drawable);
+}
+
+static void
+submit_copy_bits (qxl_screen_t *qxl, qxl_surface_t *surface,
+		  int x1, int y1, int x2, int y2, int src_x, int src_y)
+{
+    struct QXLDrawable *drawable;
+    struct QXLRect rect;
+
+    rect.left = x1;
+    rect.right = x2;
+    rect.top = y1;
+    rect.bottom = y2;
+
+    drawable = make_drawable (qxl, surface, QXL_COPY_BITS, &rect);
+
+    drawable->u.copy_bits.src_pos.x = src_x + surface->atlas_x;
+    drawable->u.copy_bits.src_pos.y = src_y + surface->atlas_y;
+
+    push_drawable (qxl, surface, drawable);
 }
 
 static qxl_surface_t *
@@ -558,6 +735,7 @@ surface_send_create (surface_cache_t *cache,
     int stride;
     uint32_t *dev_addr;
     int n_attempts = 0;
+    Bool compacted = FALSE;
     qxl_screen_t *qxl = cache->qxl;
     qxl_surface_t *surface;
     void *address;
@@ -573,7 +751,6 @@ surface_send_create (surface_cache_t *cache,
     /* the final + stride is to work around a bug where the device apparently 
      * scribbles after the end of the image
      */
-    qxl_garbage_collect (cache->qxl);
 retry2:
     address = qxl_alloc (qxl->surf_mem, stride * height + stride);
 
@@ -581,6 +758,8 @@ retry2:
     {
 	ErrorF ("- %dth attempt\n", n_attempts++);
 
+	qxl_mem_count_retry (qxl->surf_mem);
+
 	if (qxl_garbage_collect (qxl))
 	    goto retry2;
 
@@ -594,6 +773,15 @@ retry2:
 	    goto retry2;
 	}
 
+	/* Enough may be free, just not in one piece */
+	if (!compacted && !cache->compacting)
+	{
+	    compacted = TRUE;
+
+	    if (compact_vram (cache, stride * height + stride))
+		goto retry2;
+	}
+
 	ErrorF ("Out of video memory: Could not allocate %d bytes\n",
 		stride * height + stride);
 	
@@ -648,6 +836,206 @@ retry:
     return surface;
 }
 
+/*
+ * Atlases
+ *
+ * Pixmaps up to ATLAS_MAX_SLOT pixels in each direction share square
+ * ATLAS_SIZE surfaces instead of getting one each, which saves surface
+ * ids and create and destroy commands. An atlas is cut into square
+ * slots by a quadtree, each node of which is free, split into four
+ * children or used. A pixmap gets the smallest slot it fits in and a
+ * qxl_surface_t of its own, with images that are views of the slot,
+ * the id of the atlas and drawing offset by the slot position.
+ */
+#define ATLAS_SIZE	512
+#define ATLAS_MAX_SLOT	128
+#define ATLAS_MIN_SLOT	16
+#define ATLAS_NODES	1365	/* 1 + 4 + ... + 4^5, down to 16 x 16 */
+
+enum { NODE_FREE, NODE_SPLIT, NODE_USED };
+
+struct atlas_t
+{
+    qxl_surface_t *	surface;
+    int			n_slots;
+    uint8_t		nodes[ATLAS_NODES];	/* children of n at 4n + 1 */
+
+    atlas_t *		next;
+};
+
+/* Finds a free node of @slot_size below @node, which is @size at
+ * @x, @y, and marks it used. Partly used nodes are tried before
+ * splitting free ones.
+ */
+static int
+atlas_find (atlas_t *atlas, int node, int size, int x, int y,
+	    int slot_size, int *slot_x, int *slot_y)
+{
+    int half = size / 2;
+    int pass, i;
+
+    if (size == slot_size)
+    {
+	if (atlas->nodes[node] != NODE_FREE)
+	    return -1;
+
+	atlas->nodes[node] = NODE_USED;
+	*slot_x = x;
+	*slot_y = y;
+	return node;
+    }
+
+    if (atlas->nodes[node] == NODE_USED)
+	return -1;
+
+    if (atlas->nodes[node] == NODE_FREE)
+    {
+	atlas->nodes[node] = NODE_SPLIT;
+	for (i = 1; i <= 4; ++i)
+	    atlas->nodes[4 * node + i] = NODE_FREE;
+    }
+
+    for (pass = 0; pass < 2; ++pass)
+    {
+	for (i = 0; i < 4; ++i)
+	{
+	    int child = 4 * node + 1 + i;
+	    int result;
+
+	    if ((atlas->nodes[child] == NODE_SPLIT) != (pass == 0))
+		continue;
+
+	    result = atlas_find (atlas, child, half,
+				 x + (i & 1) * half, y + (i >> 1) * half,
+				 slot_size, slot_x, slot_y);
+	    if (result >= 0)
+		return result;
+	}
+    }
+
+    /* Nothing fit, so leave the node as it was found if that was free */
+    for (i = 1; i <= 4; ++i)
+    {
+	if (atlas->nodes[4 * node + i] != NODE_FREE)
+	    return -1;
+    }
+
+    atlas->nodes[node] = NODE_FREE;
+    return -1;
+}
+
+static void
+atlas_release (atlas_t *atlas, int node)
+{
+    atlas->nodes[node] = NODE_FREE;
+
+    while (node > 0)
+    {
+	int parent = (node - 1) / 4;
+	int i;
+
+	for (i = 1; i <= 4; ++i)
+	{
+	    if (atlas->nodes[4 * parent + i] != NODE_FREE)
+		return;
+	}
+
+	atlas->nodes[parent] = NODE_FREE;
+	node = parent;
+    }
+}
+
+static qxl_surface_t *
+atlas_create_slot (surface_cache_t *cache, int width, int height, int bpp)
+{
+    SpiceBitmapFmt format;
+    pixman_format_code_t pformat;
+    int slot_size = ATLAS_MIN_SLOT;
+    int node = -1, x, y;
+    int stride, Bpp;
+    uint8_t *data;
+    qxl_surface_t *slot;
+    atlas_t *atlas;
+
+    while (slot_size < width || slot_size < height)
+	slot_size *= 2;
+
+    for (atlas = cache->atlases; atlas; atlas = atlas->next)
+    {
+	if (atlas->surface->bpp != bpp)
+	    continue;
+
+	node = atlas_find (atlas, 0, ATLAS_SIZE, 0, 0, slot_size, &x, &y);
+	if (node >= 0)
+	    break;
+    }
+
+    if (!(slot = calloc (1, sizeof *slot)))
+    {
+	if (atlas)
+	    atlas_release (atlas, node);
+	return NULL;
+    }
+
+    if (!atlas)
+    {
+	qxl_surface_t *surface;
+
+	if (!(atlas = calloc (1, sizeof *atlas)))
+	{
+	    free (slot);
+	    return NULL;
+	}
+
+	if (!(surface = surface_send_create (cache, ATLAS_SIZE, ATLAS_SIZE, bpp)))
+	{
+	    free (atlas);
+	    free (slot);
+	    return NULL;
+	}
+
+	/* Slots have host images of their own */
+	pixman_image_unref (surface->host_image);
+	surface->host_image = NULL;
+
+	atlas->surface = surface;
+	atlas->next = cache->atlases;
+	cache->atlases = atlas;
+
+	node = atlas_find (atlas, 0, ATLAS_SIZE, 0, 0, slot_size, &x, &y);
+    }
+
+    atlas->n_slots++;
+
+    get_formats (bpp, &format, &pformat);
+    Bpp = PIXMAN_FORMAT_BPP (pformat) / 8;
+    stride = pixman_image_get_stride (atlas->surface->dev_image);
+    data = (uint8_t *)pixman_image_get_data (atlas->surface->dev_image);
+
+    slot->dev_image = pixman_image_create_bits (
+	pformat, width, height, (uint32_t *)(data + y * stride + x * Bpp), stride);
+    slot->host_image = pixman_image_create_bits (
+	pformat, width, height, NULL, -1);
+
+    slot->id = atlas->surface->id;
+    slot->cache = cache;
+    slot->address = atlas->surface->address;
+    slot->end = atlas->surface->end;
+    slot->in_use = TRUE;
+    slot->bpp = bpp;
+    slot->ref_count = 1;
+    slot->bucket = -1;
+    slot->atlas = atlas;
+    slot->atlas_node = node;
+    slot->atlas_x = x;
+    slot->atlas_y = y;
+
+    REGION_INIT (NULL, &(slot->access_region), (BoxPtr)NULL, 0);
+    slot->access_type = UXA_ACCESS_RO;
+
+    return slot;
+}
+
 qxl_surface_t *
 qxl_surface_create (surface_cache_t *    cache,
 		    int			 width,
@@ -689,9 +1077,15 @@ qxl_surface_create (surface_cache_t *    cache,
 	return NULL;
     }
 
-    if (!(surface = surface_get_from_cache (cache, width, height, bpp)))
-	if (!(surface = surface_send_create (cache, width, height, bpp)))
-	    return NULL;
+    if (width <= ATLAS_MAX_SLOT && height <= ATLAS_MAX_SLOT)
+	surface = atlas_create_slot (cache, width, height, bpp);
+    else
+	surface = NULL;
+
+    if (!surface)
+	if (!(surface = surface_get_from_cache (cache, width, height, bpp)))
+	    if (!(surface = surface_send_create (cache, width, height, bpp)))
+		return NULL;
     
     surface->next = cache->live_surfaces;
     surface->prev = NULL;
@@ -714,6 +1108,121 @@ qxl_surface_set_pixmap (qxl_surface_t *surface, PixmapPtr pixmap)
 #endif
 }
 
+/*
+ * Line hashes
+ */
+static void
+free_line_hashes (qxl_surface_t *surface)
+{
+    free (surface->line_hashes);
+    surface->line_hashes = NULL;
+    surface->n_cells = 0;
+}
+
+static Bool
+ensure_line_hashes (qxl_surface_t *surface)
+{
+    int width, height;
+
+    if (surface->line_hashes)
+	return TRUE;
+
+    if (!surface->host_image)
+	return FALSE;
+
+    width = pixman_image_get_width (surface->host_image);
+    height = pixman_image_get_height (surface->host_image);
+
+    surface->n_cells = (width + CELL_WIDTH - 1) / CELL_WIDTH;
+    surface->line_hashes =
+	calloc ((size_t)surface->n_cells * height, sizeof (uint64_t));
+
+    if (!surface->line_hashes)
+	surface->n_cells = 0;
+
+    return surface->line_hashes != NULL;
+}
+
+static uint64_t
+hash_cell (qxl_surface_t *surface, int cx, int y)
+{
+    int Bpp = PIXMAN_FORMAT_BPP (pixman_image_get_format (surface->host_image)) / 8;
+    int width = pixman_image_get_width (surface->host_image);
+    int stride = pixman_image_get_stride (surface->host_image);
+    uint8_t *line = (uint8_t *)pixman_image_get_data (surface->host_image) + y * stride;
+    int x1 = cx * CELL_WIDTH;
+    int x2 = MIN (x1 + CELL_WIDTH, width);
+    uint64_t digest[2];
+
+    MurmurHash3_x64_128 (line + x1 * Bpp, (x2 - x1) * Bpp, 0, digest);
+
+    /* 0 means unknown */
+    return digest[0]? digest[0] : 1;
+}
+
+/* The cells of the box that it covers completely and the ones that
+ * it only touches
+ */
+static void
+box_cells (qxl_surface_t *surface, int x1, int x2,
+	   int *inner1, int *inner2, int *outer1, int *outer2)
+{
+    int width = pixman_image_get_width (surface->host_image);
+
+    *outer1 = x1 / CELL_WIDTH;
+    *outer2 = (x2 + CELL_WIDTH - 1) / CELL_WIDTH;
+    *inner1 = (x1 + CELL_WIDTH - 1) / CELL_WIDTH;
+    *inner2 = (x2 == width)? *outer2 : x2 / CELL_WIDTH;
+}
+
+/* Called when the host image matches the device in the box */
+static void
+record_line_hashes (qxl_surface_t *surface, int x1, int y1, int x2, int y2)
+{
+    int inner1, inner2, outer1, outer2;
+    int cx, y;
+
+    if (!ensure_line_hashes (surface))
+	return;
+
+    box_cells (surface, x1, x2, &inner1, &inner2, &outer1, &outer2);
+
+    for (y = y1; y < y2; ++y)
+    {
+	uint64_t *hashes = surface->line_hashes + y * surface->n_cells;
+
+	for (cx = inner1; cx < inner2; ++cx)
+	    hashes[cx] = hash_cell (surface, cx, y);
+    }
+}
+
+/* Called when the device changes in the box behind our back */
+static void
+invalidate_line_hashes (qxl_surface_t *surface, int x1, int y1, int x2, int y2)
+{
+    int inner1, inner2, outer1, outer2;
+    int y;
+
+    if (!surface->line_hashes)
+	return;
+
+    x1 = MAX (x1, 0);
+    y1 = MAX (y1, 0);
+    x2 = MIN (x2, pixman_image_get_width (surface->host_image));
+    y2 = MIN (y2, pixman_image_get_height (surface->host_image));
+
+    if (x1 >= x2)
+	return;
+
+    box_cells (surface, x1, x2, &inner1, &inner2, &outer1, &outer2);
+
+    for (y = y1; y < y2; ++y)
+    {
+	memset (surface->line_hashes + y * surface->n_cells + outer1, 0,
+		(outer2 - outer1) * sizeof (uint64_t));
+    }
+}
+
 static void
 unlink_surface (qxl_surface_t *surface)
 {
@@ -740,81 +1249,64 @@ send_destroy (qxl_surface_t *surface)
 	pixman_image_unref (surface->dev_image);
     if (surface->host_image)
 	pixman_image_unref (surface->host_image);
+
+    free_line_hashes (surface);
     
     cmd = make_surface_cmd (surface->cache, surface->id, QXL_SURFACE_CMD_DESTROY);
     
     push_surface_cmd (surface->cache, cmd);
 }
 
+/* Takes a reference that the cache holds, or nothing if the surface
+ * can't be cached
+ */
 static void
 surface_add_to_cache (qxl_surface_t *surface)
 {
     surface_cache_t *cache = surface->cache;
-    int oldest = -1;
-    int n_surfaces = 0;
-    int i, delta;
-    int destroy_id = -1;
-    qxl_surface_t *destroy_surface = NULL;
+    int width = pixman_image_get_width (surface->host_image);
+    int height = pixman_image_get_height (surface->host_image);
+    int bucket = bucket_index (surface->bpp,
+			       class_of_surface (width), class_of_surface (height));
+    unsigned long n_bytes = surface_bytes (surface);
+
+    if (bucket < 0 || n_bytes > cache->max_cached_bytes)
+	return;
 
     surface->ref_count++;
-    
-    for (i = 0; i < N_CACHED_SURFACES; ++i)
-    {
-	if (cache->cached_surfaces[i])
-	{
-	    oldest = i;
-	    n_surfaces++;
-	}
-    }
-    
-    if (n_surfaces == N_CACHED_SURFACES)
-    {
-	int i;
-	destroy_id = cache->cached_surfaces[oldest]->id;
-	
-	destroy_surface = cache->cached_surfaces[oldest];
-	
-	cache->cached_surfaces[oldest] = NULL;
-	
-	for (i = 0; i < N_CACHED_SURFACES; ++i)
-	    assert (!cache->cached_surfaces[i] ||
-		    cache->cached_surfaces[i]->id != destroy_id);
-    }
-    
-    delta = 0;
-    for (i = N_CACHED_SURFACES - 1; i >= 0; i--)
-    {
-	if (cache->cached_surfaces[i])
-	{
-	    if (delta > 0)
-	    {
-		cache->cached_surfaces[i + delta] =
-		    cache->cached_surfaces[i];
-		
-		assert (cache->cached_surfaces[i + delta]->id != destroy_id);
-		
-		cache->cached_surfaces[i] = NULL;
-	    }
-	}
-	else
-	{
-	    delta++;
-	}
-    }
-    
-    assert (delta > 0);
-    
-    cache->cached_surfaces[i + delta] = surface;
-    
-    for (i = 0; i < N_CACHED_SURFACES; ++i)
-	assert (!cache->cached_surfaces[i] || cache->cached_surfaces[i]->id != destroy_id);
+
+    surface->bucket = bucket;
+    surface->prev = NULL;
+    surface->next = cache->buckets[bucket];
+    if (surface->next)
+	surface->next->prev = surface;
+    cache->buckets[bucket] = surface;
+
+    surface->lru_prev = NULL;
+    surface->lru_next = cache->lru_head;
+    if (surface->lru_next)
+	surface->lru_next->lru_prev = surface;
+    else
+	cache->lru_tail = surface;
+    cache->lru_head = surface;
+
+    cache->n_cached++;
+    cache->cached_bytes += n_bytes;
 
     /* Note that sending a destroy command can trigger callbacks into
-     * this function (due to memory management), so we have to
-     * do this after updating the cache
+     * this function (due to memory management), so each surface is
+     * removed from the cache before it is unreferenced
      */
-    if (destroy_surface)
-	qxl_surface_unref (destroy_surface->cache, destroy_surface->id);
+    while (cache->cached_bytes > cache->max_cached_bytes ||
+	   cache->n_cached > N_CACHED_SURFACES)
+    {
+	qxl_surface_t *oldest = cache->lru_tail;
+
+	cache_remove (cache, oldest);
+	cache->n_evictions++;
+
+	qxl_surface_unref (cache, oldest->id);
+    }
     
 #if 0
     ErrorF ("Done\n");
@@ -838,11 +1330,58 @@ qxl_surface_unref (surface_cache_t *cache, uint32_t id)
     }
 }
 
+static void
+atlas_destroy_slot (qxl_surface_t *slot)
+{
+    surface_cache_t *cache = slot->cache;
+    atlas_t *atlas = slot->atlas;
+    atlas_t *a;
+    int n_atlases = 0;
+
+    free_line_hashes (slot);
+    pixman_image_unref (slot->dev_image);
+    pixman_image_unref (slot->host_image);
+    REGION_UNINIT (NULL, &(slot->access_region));
+
+    atlas_release (atlas, slot->atlas_node);
+    free (slot);
+
+    if (--atlas->n_slots > 0)
+	return;
+
+    /* Keep one empty atlas per format, so a pixmap coming and going
+     * doesn't create and destroy atlases
+     */
+    for (a = cache->atlases; a; a = a->next)
+    {
+	if (a->surface->bpp == atlas->surface->bpp)
+	    n_atlases++;
+    }
+
+    if (n_atlases > 1)
+    {
+	atlas_t **prev;
+
+	for (prev = &cache->atlases; *prev != atlas; prev = &(*prev)->next)
+	    ;
+	*prev = atlas->next;
+
+	qxl_surface_unref (cache, atlas->surface->id);
+	free (atlas);
+    }
+}
+
 void
 qxl_surface_kill (qxl_surface_t *surface)
 {
     unlink_surface (surface);
 
+    if (surface->atlas)
+    {
+	atlas_destroy_slot (surface);
+	return;
+    }
+
 #if 0
     ErrorF ("killed %d (%d %d %d)\n", surface->id,
 	    pixman_image_get_width (surface->host_image),
@@ -850,9 +1389,9 @@ qxl_surface_kill (qxl_surface_t *surface)
 	    surface->bpp);
 #endif
     
-    if (surface->id != 0					&&
-	pixman_image_get_width (surface->host_image) >= 128	&&
-	pixman_image_get_height (surface->host_image) >= 128)
+    if (surface->id != 0							&&
+	pixman_image_get_width (surface->host_image) >= MIN_CACHED_SIZE	&&
+	pixman_image_get_height (surface->host_image) >= MIN_CACHED_SIZE)
     {
 #if 0
 	ErrorF ("Adding %d to cache\n", surface->id);
@@ -865,6 +1404,9 @@ qxl_surface_kill (qxl_surface_t *surface)
     print_cache_info (surface->cache);
 #endif
     
+    if (surface->id == 0)
+	free_line_hashes (surface);
+
     qxl_surface_unref (surface->cache, surface->id);
 
 #if 0
@@ -886,10 +1428,10 @@ download_box (qxl_surface_t *surface, int x1, int y1, int x2, int y2)
 {
     struct QXLRam *ram_header = get_ram_header (surface->cache->qxl);
     
-    ram_header->update_area.top = y1;
-    ram_header->update_area.bottom = y2;
-    ram_header->update_area.left = x1;
-    ram_header->update_area.right = x2;
+    ram_header->update_area.top = y1 + surface->atlas_y;
+    ram_header->update_area.bottom = y2 + surface->atlas_y;
+    ram_header->update_area.left = x1 + surface->atlas_x;
+    ram_header->update_area.right = x2 + surface->atlas_x;
     
     ram_header->update_surface = surface->id;
 
@@ -899,11 +1441,54 @@ download_box (qxl_surface_t *surface, int x1, int y1, int x2, int y2)
 
     qxl_update_area(surface->cache->qxl,surface);
 
-    pixman_image_composite (PIXMAN_OP_SRC,
-     			    surface->dev_image,
-			    NULL,
-			    surface->host_image,
-			    x1, y1, 0, 0, x1, y1, x2 - x1, y2 - y1);
+    if (pixman_image_get_format (surface->dev_image) ==
+	pixman_image_get_format (surface->host_image))
+    {
+	/* Same format, so this is a plain copy of each line. Only the
+	 * primary is in write-combined RAM, where streaming loads are
+	 * fast; the VRAM BAR is mapped uncached, and they gain nothing
+	 * there.
+	 */
+	Bool primary = surface->id == 0;
+	int Bpp = PIXMAN_FORMAT_BPP (pixman_image_get_format (surface->dev_image)) / 8;
+	int dev_stride = pixman_image_get_stride (surface->dev_image);
+	int host_stride = pixman_image_get_stride (surface->host_image);
+	uint8_t *dev_data = (uint8_t *)pixman_image_get_data (surface->dev_image);
+	uint8_t *host_data = (uint8_t *)pixman_image_get_data (surface->host_image);
+	int width = MIN (pixman_image_get_width (surface->dev_image),
+			 pixman_image_get_width (surface->host_image));
+	int height = MIN (pixman_image_get_height (surface->dev_image),
+			  pixman_image_get_height (surface->host_image));
+	int y;
+
+	/* pixman_image_composite() would have clipped for us */
+	x1 = MAX (x1, 0);
+	y1 = MAX (y1, 0);
+	x2 = MIN (x2, width);
+	y2 = MIN (y2, height);
+
+	if (x1 >= x2)
+	    return;
+
+	for (y = y1; y < y2; ++y)
+	{
+	    uint8_t *d = host_data + y * host_stride + x1 * Bpp;
+	    uint8_t *s = dev_data + y * dev_stride + x1 * Bpp;
+
+	    if (primary)
+		qxl_wc_read (d, s, (x2 - x1) * Bpp);
+	    else
+		memcpy (d, s, (x2 - x1) * Bpp);
+	}
+    }
+    else
+    {
+	pixman_image_composite (PIXMAN_OP_SRC,
+				surface->dev_image,
+				NULL,
+				surface->host_image,
+				x1, y1, 0, 0, x1, y1, x2 - x1, y2 - y1);
+    }
 }
 
 Bool
@@ -951,6 +1536,7 @@ qxl_surface_prepare_access (qxl_surface_t  *surface,
 	while (n_boxes--)
 	{
 	    download_box (surface, boxes->x1, boxes->y1, boxes->x2, boxes->y2);
+	    record_line_hashes (surface, boxes->x1, boxes->y1, boxes->x2, boxes->y2);
 	    
 	    boxes++;
 	}
@@ -962,6 +1548,7 @@ qxl_surface_prepare_access (qxl_surface_t  *surface,
 #endif
 	
 	download_box (surface, new.extents.x1, new.extents.y1, new.extents.x2, new.extents.y2);
+	record_line_hashes (surface, new.extents.x1, new.extents.y1, new.extents.x2, new.extents.y2);
     }
     
     REGION_UNION (pScreen,
@@ -1000,6 +1587,53 @@ translate_rect (struct QXLRect *rect)
     rect->left = rect->top = 0;
 }
 
+/* If every pixel in the box has the same value, return TRUE and store
+ * the value in @pixel. The first line is compared against itself
+ * shifted by one pixel, and every other line against the first, so
+ * the work is done by memcmp() and non-uniform boxes usually bail out
+ * within the first few bytes.
+ */
+static Bool
+is_uniform (const uint8_t *data, int stride, int Bpp,
+	    int width, int height, uint32_t *pixel)
+{
+    int n_bytes = width * Bpp;
+    int y;
+
+    if (width <= 0 || height <= 0)
+	return FALSE;
+
+    if (memcmp (data, data + Bpp, n_bytes - Bpp) != 0)
+	return FALSE;
+
+    for (y = 1; y < height; ++y)
+    {
+	if (memcmp (data, data + y * stride, n_bytes) != 0)
+	    return FALSE;
+    }
+
+    if (Bpp == 4)
+    {
+	uint32_t p32;
+
+	memcpy (&p32, data, sizeof p32);
+	*pixel = p32;
+    }
+    else if (Bpp == 2)
+    {
+	uint16_t p16;
+
+	memcpy (&p16, data, sizeof p16);
+	*pixel = p16;
+    }
+    else
+    {
+	*pixel = *data;
+    }
+
+    return TRUE;
+}
+
 static void
 real_upload_box (qxl_surface_t *surface, int x1, int y1, int x2, int y2)
 {
@@ -1007,15 +1641,27 @@ real_upload_box (qxl_surface_t *surface, int x1, int y1, int x2, int y2)
     struct QXLDrawable *drawable;
     struct QXLImage *image;
     qxl_screen_t *qxl = surface->cache->qxl;
+    int Bpp = surface->bpp == 24 ? 4 : surface->bpp / 8;
     uint32_t *data;
+    uint32_t pixel;
     int stride;
     
     rect.left = x1;
     rect.right = x2;
     rect.top = y1;
     rect.bottom = y2;
+
+    data = pixman_image_get_data (surface->host_image);
+    stride = pixman_image_get_stride (surface->host_image);
+
+    if (is_uniform ((const uint8_t *)data + y1 * stride + x1 * Bpp, stride, Bpp,
+		    x2 - x1, y2 - y1, &pixel))
+    {
+	submit_fill (qxl, surface, &rect, pixel);
+	return;
+    }
     
-    drawable = make_drawable (qxl, surface->id, QXL_DRAW_COPY, &rect);
+    drawable = make_drawable (qxl, surface, QXL_DRAW_COPY, &rect);
     drawable->u.copy.src_area = rect;
     translate_rect (&drawable->u.copy.src_area);
     drawable->u.copy.rop_descriptor = ROPD_OP_PUT;
@@ -1025,16 +1671,13 @@ real_upload_box (qxl_surface_t *surface, int x1, int y1, int x2, int y2)
     drawable->u.copy.mask.pos.y = 0;
     drawable->u.copy.mask.bitmap = 0;
 
-    data = pixman_image_get_data (surface->host_image);
-    stride = pixman_image_get_stride (surface->host_image);
-    
     image = qxl_image_create (
 	qxl, (const uint8_t *)data, x1, y1, x2 - x1, y2 - y1, stride, 
-	surface->bpp == 24 ? 4 : surface->bpp / 8, TRUE);
+	Bpp, TRUE);
     drawable->u.copy.src_bitmap =
 	physical_address (qxl, image, qxl->main_mem_slot);
     
-    push_drawable (qxl, drawable);
+    push_drawable (qxl, surface, drawable);
 }
 
 #define TILE_WIDTH 512
@@ -1062,6 +1705,262 @@ upload_box (qxl_surface_t *surface, int x1, int y1, int x2, int y2)
     }
 }
 
+#define KEY_MULTIPLIER 0x9e3779b97f4a7c15ULL
+#define MIN_SCROLL_LINES 16
+
+/* Combines the cell hashes of a line into one key, 0 if any is unknown */
+static uint64_t
+line_key (const uint64_t *hashes, int n)
+{
+    uint64_t key = 0;
+    int i;
+
+    for (i = 0; i < n; ++i)
+    {
+	if (!hashes[i])
+	    return 0;
+
+	key = (key ^ hashes[i]) * KEY_MULTIPLIER;
+    }
+
+    return key? key : 1;
+}
+
+/* Looks for a vertical shift of the old lines that explains most of
+ * the new ones. A few sample lines are looked up among the old lines;
+ * a sample that matches exactly one old line gives a candidate shift,
+ * which is accepted if the matching run around the sample covers at
+ * least half of the box. Returns the shift (new line y shows old line
+ * y + dy) and the run, or 0.
+ */
+static int
+find_scroll (const uint64_t *old_keys, const uint64_t *new_keys, int n_lines,
+	     int *first, int *last)
+{
+    static const int quarters[] = { 2, 1, 3 };
+    unsigned int i;
+
+    for (i = 0; i < sizeof (quarters) / sizeof (quarters[0]); ++i)
+    {
+	int sample = n_lines * quarters[i] / 4;
+	int match = -1, n_matches = 0;
+	int dy, a, b, y;
+
+	for (y = 0; y < n_lines; ++y)
+	{
+	    if (old_keys[y] && old_keys[y] == new_keys[sample])
+	    {
+		match = y;
+		n_matches++;
+	    }
+	}
+
+	if (n_matches != 1 || match == sample)
+	    continue;
+
+	dy = match - sample;
+
+	a = sample;
+	while (a > 0 && a - 1 + dy >= 0 &&
+	       old_keys[a - 1 + dy] && new_keys[a - 1] == old_keys[a - 1 + dy])
+	{
+	    a--;
+	}
+
+	b = sample + 1;
+	while (b < n_lines && b + dy < n_lines &&
+	       old_keys[b + dy] && new_keys[b] == old_keys[b + dy])
+	{
+	    b++;
+	}
+
+	if (b - a >= MAX (MIN_SCROLL_LINES, n_lines / 2))
+	{
+	    *first = a;
+	    *last = b;
+	    return dy;
+	}
+    }
+
+    return 0;
+}
+
+/* If the box is mostly the old content moved up or down, tell the
+ * device to move it with QXL_COPY_BITS and update the line hashes to
+ * match, so only the exposed lines are left to upload. Only whole
+ * cells are compared, so the box must cover its cells completely.
+ */
+static void
+detect_scroll (qxl_surface_t *surface, int x1, int y1, int x2, int y2,
+	       int cx1, int cx2, const uint64_t *fresh)
+{
+    int n_lines = y2 - y1;
+    int n = cx2 - cx1;
+    uint64_t *old_keys, *new_keys;
+    int first, last, dy, y;
+
+    if (n_lines < 2 * MIN_SCROLL_LINES || n <= 0)
+	return;
+
+    old_keys = malloc (n_lines * sizeof (uint64_t));
+    new_keys = malloc (n_lines * sizeof (uint64_t));
+    if (!old_keys || !new_keys)
+	goto out;
+
+    for (y = 0; y < n_lines; ++y)
+    {
+	old_keys[y] = line_key (
+	    surface->line_hashes + (y1 + y) * surface->n_cells + cx1, n);
+	new_keys[y] = line_key (fresh + y * n, n);
+    }
+
+    if (!(dy = find_scroll (old_keys, new_keys, n_lines, &first, &last)))
+	goto out;
+
+#if 0
+    ErrorF ("scroll by %d in lines %d to %d\n", dy, y1 + first, y1 + last);
+#endif
+
+    submit_copy_bits (surface->cache->qxl, surface,
+		      x1, y1 + first, x2, y1 + last, x1, y1 + first + dy);
+
+    /* Move the hashes the same way, in the order that doesn't
+     * overwrite lines still to be read
+     */
+    for (y = 0; y < last - first; ++y)
+    {
+	int dest = (dy > 0)? y1 + first + y : y1 + last - 1 - y;
+
+	memcpy (surface->line_hashes + dest * surface->n_cells + cx1,
+		surface->line_hashes + (dest + dy) * surface->n_cells + cx1,
+		n * sizeof (uint64_t));
+    }
+
+out:
+    free (old_keys);
+    free (new_keys);
+}
+
+/* Uploads the lines of the box whose cells differ from what the
+ * device has, as runs of consecutive changed lines narrowed to the
+ * changed columns. Cells the box only partly covers, and cells we
+ * know nothing about, count as changed.
+ */
+static void
+upload_changed (qxl_surface_t *surface, int x1, int y1, int x2, int y2)
+{
+    int inner1, inner2, outer1, outer2;
+    int run_y1 = -1, run_x1 = 0, run_x2 = 0;
+    uint64_t *fresh = NULL;
+    int n_inner;
+    int y;
+
+    x1 = MAX (x1, 0);
+    y1 = MAX (y1, 0);
+    x2 = MIN (x2, pixman_image_get_width (surface->host_image));
+    y2 = MIN (y2, pixman_image_get_height (surface->host_image));
+
+    if (x1 >= x2 || y1 >= y2)
+	return;
+
+    if (!ensure_line_hashes (surface))
+    {
+	upload_box (surface, x1, y1, x2, y2);
+	return;
+    }
+
+    box_cells (surface, x1, x2, &inner1, &inner2, &outer1, &outer2);
+    n_inner = MAX (inner2 - inner1, 0);
+
+    /* Hash the new content up front so it can be searched for
+     * scrolled lines
+     */
+    if (n_inner && (fresh = malloc ((size_t)(y2 - y1) * n_inner * sizeof (uint64_t))))
+    {
+	int cx;
+
+	for (y = y1; y < y2; ++y)
+	{
+	    for (cx = inner1; cx < inner2; ++cx)
+		fresh[(y - y1) * n_inner + cx - inner1] = hash_cell (surface, cx, y);
+	}
+
+	if (inner1 == outer1 && inner2 == outer2)
+	    detect_scroll (surface, x1, y1, x2, y2, inner1, inner2, fresh);
+    }
+
+    for (y = y1; y < y2; ++y)
+    {
+	uint64_t *hashes = surface->line_hashes + y * surface->n_cells;
+	int changed_x1 = x2, changed_x2 = x1;
+	int cx;
+
+	/* Partial cells are always uploaded, so what the device has no
+	 * longer matches their recorded hash
+	 */
+	if (outer1 < inner1)
+	{
+	    hashes[outer1] = 0;
+
+	    changed_x1 = x1;
+	    changed_x2 = MIN ((outer1 + 1) * CELL_WIDTH, x2);
+	}
+
+	for (cx = inner1; cx < inner2; ++cx)
+	{
+	    uint64_t hash;
+
+	    if (fresh)
+		hash = fresh[(y - y1) * n_inner + cx - inner1];
+	    else
+		hash = hash_cell (surface, cx, y);
+
+	    if (hash != hashes[cx])
+	    {
+		/* It is about to be uploaded */
+		hashes[cx] = hash;
+
+		changed_x1 = MIN (changed_x1, cx * CELL_WIDTH);
+		changed_x2 = MAX (changed_x2, MIN ((cx + 1) * CELL_WIDTH, x2));
+	    }
+	}
+
+	if (inner2 < outer2)
+	{
+	    for (cx = inner2; cx < outer2; ++cx)
+		hashes[cx] = 0;
+
+	    changed_x1 = MIN (changed_x1, MAX (inner2 * CELL_WIDTH, x1));
+	    changed_x2 = x2;
+	}
+
+	if (changed_x1 < changed_x2)
+	{
+	    if (run_y1 < 0)
+	    {
+		run_y1 = y;
+		run_x1 = changed_x1;
+		run_x2 = changed_x2;
+	    }
+	    else
+	    {
+		run_x1 = MIN (run_x1, changed_x1);
+		run_x2 = MAX (run_x2, changed_x2);
+	    }
+	}
+	else if (run_y1 >= 0)
+	{
+	    upload_box (surface, run_x1, run_y1, run_x2, y);
+	    run_y1 = -1;
+	}
+    }
+
+    if (run_y1 >= 0)
+	upload_box (surface, run_x1, run_y1, run_x2, y2);
+
+    free (fresh);
+}
+
 void
 qxl_surface_finish_access (qxl_surface_t *surface, PixmapPtr pixmap)
 {
@@ -1080,14 +1979,14 @@ qxl_surface_finish_access (qxl_surface_t *surface, PixmapPtr pixmap)
 	{
 	    while (n_boxes--)
 	    {
-		upload_box (surface, boxes->x1, boxes->y1, boxes->x2, boxes->y2);
+		upload_changed (surface, boxes->x1, boxes->y1, boxes->x2, boxes->y2);
 		
 		boxes++;
 	    }
 	}
 	else
 	{
-	    upload_box (surface,
+	    upload_changed (surface,
 			surface->access_region.extents.x1,
 			surface->access_region.extents.y1,
 			surface->access_region.extents.x2,
@@ -1111,13 +2010,12 @@ qxl_surface_cache_evacuate_all (surface_cache_t *cache)
 #if 0
     ErrorF ("Before evacucate\n");
 #endif
-    for (i = 0; i < N_CACHED_SURFACES; ++i)
+    while (cache->lru_head)
     {
-	if (cache->cached_surfaces[i])
-	{
-	    send_destroy (cache->cached_surfaces[i]);
-	    cache->cached_surfaces[i] = NULL;
-	}
+	s = cache->lru_head;
+
+	cache_remove (cache, s);
+	send_destroy (s);
     }
 
 #if 0
@@ -1148,8 +2046,16 @@ qxl_surface_cache_evacuate_all (surface_cache_t *cache)
 	evacuated->bpp = s->bpp;
 	
 	s->host_image = NULL;
+	free_line_hashes (s);
 
 	unlink_surface (s);
+
+	if (s->atlas)
+	{
+	    pixman_image_unref (s->dev_image);
+	    REGION_UNINIT (NULL, &(s->access_region));
+	    free (s);
+	}
 	
 	evacuated->next = evacuated_surfaces;
 	evacuated_surfaces = evacuated;
@@ -1157,6 +2063,15 @@ qxl_surface_cache_evacuate_all (surface_cache_t *cache)
 	s = next;
     }
 
+    /* The atlas surfaces go with all the others */
+    while (cache->atlases)
+    {
+	atlas_t *next = cache->atlases->next;
+
+	free (cache->atlases);
+	cache->atlases = next;
+    }
+
     free (cache->all_surfaces);
     cache->all_surfaces = NULL;
     cache->live_surfaces = NULL;
@@ -1217,6 +2132,335 @@ qxl_surface_cache_replace_all (surface_cache_t *cache, void *data)
 
 }
 
+/*
+ * Reclaiming command memory
+ *
+ * Drawables are counted per surface id until the device releases
+ * them, whichever surface has the id by then. Surfaces with many
+ * drawables outstanding are the ones worth rendering or, when only
+ * cached, destroying.
+ */
+void
+qxl_surface_cache_drawable_released (surface_cache_t *cache, uint32_t id)
+{
+    if (cache->all_surfaces && id < cache->qxl->rom->n_surfaces)
+	cache->all_surfaces[id].n_pending--;
+}
+
+int
+qxl_surface_cache_shrink (surface_cache_t *cache)
+{
+    int n_destroyed = 0;
+
+    for (;;)
+    {
+	qxl_surface_t *s;
+
+	/* Searched again each time, since sending the destroy can
+	 * allocate and get back here
+	 */
+	for (s = cache->lru_tail; s; s = s->lru_prev)
+	{
+	    if (s->n_pending > 0)
+		break;
+	}
+
+	if (!s)
+	    break;
+
+	cache_remove (cache, s);
+	qxl_surface_unref (cache, s->id);
+	n_destroyed++;
+    }
+
+    return n_destroyed;
+}
+
+/* Renders the @max_surfaces surfaces with the most drawables pending,
+ * so the device can release them. Returns the number updated.
+ */
+int
+qxl_surface_cache_update_busy (surface_cache_t *cache, int max_surfaces)
+{
+    qxl_screen_t *qxl = cache->qxl;
+    struct QXLRam *ram_header = get_ram_header (qxl);
+    int n_surfaces = qxl->rom->n_surfaces;
+    int n_updated = 0;
+    qxl_surface_t *last = NULL;
+
+    if (!cache->all_surfaces)
+	return 0;
+
+    while (n_updated < max_surfaces)
+    {
+	qxl_surface_t *surface = NULL;
+	int i, width, height;
+
+	/* Surfaces are taken by decreasing count, then increasing id.
+	 * Those that are being destroyed can't be updated.
+	 */
+	for (i = 0; i < n_surfaces; ++i)
+	{
+	    qxl_surface_t *s = &cache->all_surfaces[i];
+
+	    if (s->n_pending <= 0)
+		continue;
+
+	    if (last && (s->n_pending > last->n_pending ||
+			 (s->n_pending == last->n_pending && i <= last->id)))
+	    {
+		continue;
+	    }
+
+	    if (i != 0 && s->ref_count <= 0)
+		continue;
+
+	    if (!surface || s->n_pending > surface->n_pending)
+		surface = s;
+	}
+
+	if (!surface)
+	    break;
+
+	last = surface;
+
+	if (surface->id == 0)
+	{
+	    width = qxl->virtual_x;
+	    height = qxl->virtual_y;
+	}
+	else
+	{
+	    width = pixman_image_get_width (surface->dev_image);
+	    height = pixman_image_get_height (surface->dev_image);
+	}
+
+	ram_header->update_area.top = 0;
+	ram_header->update_area.bottom = height;
+	ram_header->update_area.left = 0;
+	ram_header->update_area.right = width;
+	ram_header->update_surface = surface->id;
+
+	qxl_update_area (qxl, surface->id? surface : qxl->primary);
+
+	n_updated++;
+    }
+
+    return n_updated;
+}
+
+/*
+ * VRAM compaction
+ *
+ * A surface allocation can fail with plenty of VRAM free when the
+ * free space is scattered between surfaces. Then we look for the
+ * cheapest run of adjacent surfaces that, once moved out of the way,
+ * would join the free space around them into a hole large enough.
+ * Cached surfaces in the run are dropped; live ones are relocated the
+ * way evacuate_all/replace_all do it: download, create a new surface,
+ * upload into it and destroy the old one. The new surfaces are created
+ * before anything in the run is destroyed, so they can't land in the
+ * hole. The space comes back once the device releases the destroyed
+ * surfaces, which the allocation retry loop waits for.
+ */
+#define MAX_RELOCATIONS		8
+#define CHUNK_OVERHEAD		64
+
+typedef struct
+{
+    qxl_surface_t *	surface;
+    uint8_t *		start;
+    uint8_t *		end;
+    Bool		cached;
+    Bool		movable;
+} vram_block_t;
+
+static int
+compare_vram_blocks (const void *a, const void *b)
+{
+    const vram_block_t *ba = a;
+    const vram_block_t *bb = b;
+
+    return (ba->start > bb->start) - (ba->start < bb->start);
+}
+
+/* Fills in all surfaces that have VRAM, sorted by address */
+static int
+collect_vram_blocks (surface_cache_t *cache, vram_block_t *blocks)
+{
+    int n_surfaces = cache->qxl->rom->n_surfaces;
+    uint8_t *state;
+    qxl_surface_t *s;
+    int i, n_blocks;
+
+    enum { PINNED, FREE, LIVE, CACHED };
+    
+    if (!(state = calloc (n_surfaces, 1)))
+	return 0;
+
+    for (s = cache->free_surfaces; s; s = s->next)
+	state[s->id] = FREE;
+
+    /* Surfaces being accessed have pixmaps pointing at their host
+     * image, and may have changes not uploaded yet. Atlases stay.
+     */
+    for (s = cache->live_surfaces; s; s = s->next)
+    {
+	if (!s->atlas && s->pixmap && REGION_NIL (&s->access_region))
+	    state[s->id] = LIVE;
+    }
+
+    for (s = cache->lru_head; s; s = s->lru_next)
+	state[s->id] = CACHED;
+
+    n_blocks = 0;
+    for (i = 1; i < n_surfaces; ++i)
+    {
+	vram_block_t *block = &blocks[n_blocks];
+
+	s = &cache->all_surfaces[i];
+
+	if (state[i] == FREE || !s->address)
+	    continue;
+
+	/* The chunk is larger than the image: surface_send_create ()
+	 * allocates an extra line, and the allocator rounds up
+	 */
+	block->surface = s;
+	block->start = s->address;
+	block->end = (uint8_t *)s->address +
+	    qxl_mem_usable_size (cache->qxl->surf_mem, s->address);
+	block->cached = (state[i] == CACHED);
+	block->movable = (state[i] == LIVE || state[i] == CACHED);
+
+	n_blocks++;
+    }
+
+    free (state);
+
+    qsort (blocks, n_blocks, sizeof (vram_block_t), compare_vram_blocks);
+
+    return n_blocks;
+}
+
+static Bool
+relocate_surface (surface_cache_t *cache, qxl_surface_t *old)
+{
+    int width = pixman_image_get_width (old->host_image);
+    int height = pixman_image_get_height (old->host_image);
+    PixmapPtr pixmap = old->pixmap;
+    qxl_surface_t *surface;
+
+    if (!(surface = qxl_surface_create (cache, width, height, old->bpp)))
+	return FALSE;
+
+    download_box (old, 0, 0, width, height);
+
+    pixman_image_unref (surface->host_image);
+    surface->host_image = old->host_image;
+    old->host_image = NULL;
+
+    upload_box (surface, 0, 0, width, height);
+
+    unlink_surface (old);
+    free_line_hashes (old);
+
+    set_surface (pixmap, surface);
+    qxl_surface_set_pixmap (surface, pixmap);
+
+    qxl_surface_unref (cache, old->id);
+
+    return TRUE;
+}
+
+static Bool
+compact_vram (surface_cache_t *cache, unsigned long n_bytes)
+{
+    qxl_screen_t *qxl = cache->qxl;
+    uint8_t *vram_start = qxl->vram;
+    uint8_t *vram_end = vram_start + qxl->vram_size;
+    uint64_t start = qxl_get_time_us ();
+    vram_block_t *blocks;
+    unsigned long best_cost = 0;
+    int best_first = -1, best_last = -1;
+    int n_blocks, n_moved = 0;
+    int i, j;
+
+    blocks = malloc (qxl->rom->n_surfaces * sizeof (vram_block_t));
+    if (!blocks)
+	return FALSE;
+
+    n_blocks = collect_vram_blocks (cache, blocks);
+
+    for (i = 0; i < n_blocks; ++i)
+    {
+	uint8_t *hole_start = i? blocks[i - 1].end : vram_start;
+	unsigned long cost = 0;
+
+	for (j = i; j < n_blocks && j - i < MAX_RELOCATIONS; ++j)
+	{
+	    uint8_t *hole_end = (j + 1 < n_blocks)? blocks[j + 1].start : vram_end;
+
+	    if (!blocks[j].movable)
+		break;
+
+	    /* Dropping a cached surface costs nothing */
+	    if (!blocks[j].cached)
+		cost += blocks[j].end - blocks[j].start;
+
+	    if (best_first >= 0 && cost >= best_cost)
+		break;
+
+	    if (hole_end - hole_start >= n_bytes + CHUNK_OVERHEAD)
+	    {
+		best_first = i;
+		best_last = j;
+		best_cost = cost;
+		break;
+	    }
+	}
+    }
+
+    if (best_first >= 0)
+    {
+	cache->compacting = TRUE;
+
+	/* Drop the cached surfaces first, so that relocating doesn't
+	 * pick them from the cache
+	 */
+	for (i = best_first; i <= best_last; ++i)
+	{
+	    if (blocks[i].cached && blocks[i].surface->bucket >= 0)
+	    {
+		cache_remove (cache, blocks[i].surface);
+		qxl_surface_unref (cache, blocks[i].surface->id);
+		n_moved++;
+	    }
+	}
+
+	for (i = best_first; i <= best_last; ++i)
+	{
+	    if (!blocks[i].cached && relocate_surface (cache, blocks[i].surface))
+		n_moved++;
+	}
+
+	cache->compacting = FALSE;
+
+#if 0
+	ErrorF ("Compacted video memory: moved %d of %d surfaces (%lu bytes)"
+		" for %lu bytes\n", n_moved, best_last - best_first + 1,
+		best_cost, n_bytes);
+#endif
+    }
+
+    free (blocks);
+
+    /* Every relocation is a round trip to the device, so this can stall */
+    qxl_reclaim_account (qxl, QXL_RECLAIM_COMPACT_VRAM, start, n_moved > 0);
+
+    return n_moved > 0;
+}
+
 #ifdef DEBUG_REGIONS
 static void
 print_region (const char *header, RegionPtr pRegion)
@@ -1283,8 +2527,10 @@ qxl_surface_solid (qxl_surface_t *destination,
     else
 #endif
 	p = destination->u.solid_pixel;
+
+    invalidate_line_hashes (destination, x1, y1, x2, y2);
     
-    submit_fill (qxl, destination->id, &qrect, p);
+    submit_fill (qxl, destination, &qrect, p);
 }
 
 /* copy */
@@ -1326,19 +2572,30 @@ qxl_surface_copy (qxl_surface_t *dest,
     qrect.bottom = dest_y1 + height;
     qrect.left = dest_x1;
     qrect.right = dest_x1 + width;
+
+    invalidate_line_hashes (dest, dest_x1, dest_y1, dest_x1 + width, dest_y1 + height);
     
+    /* Slots of the same atlas are copied between like any other
+     * parts of one surface
+     */
     if (dest->id == dest->u.copy_src->id)
     {
-	drawable = make_drawable (qxl, dest->id, QXL_COPY_BITS, &qrect);
+	drawable = make_drawable (qxl, dest, QXL_COPY_BITS, &qrect);
 
-	drawable->u.copy_bits.src_pos.x = src_x1;
-	drawable->u.copy_bits.src_pos.y = src_y1;
+	drawable->u.copy_bits.src_pos.x = src_x1 + dest->u.copy_src->atlas_x;
+	drawable->u.copy_bits.src_pos.y = src_y1 + dest->u.copy_src->atlas_y;
     }
     else
     {
-	struct QXLImage *image = qxl_allocnf (qxl, sizeof *image);
+	struct QXLImage *image = qxl_slab_allocnf (qxl, QXL_SLAB_IMAGE);
 
-	dest->u.copy_src->ref_count++;
+	/* The reference is dropped by id when the drawable is
+	 * released, so for a slot it is on the atlas surface
+	 */
+	if (dest->u.copy_src->atlas)
+	    dest->u.copy_src->atlas->surface->ref_count++;
+	else
+	    dest->u.copy_src->ref_count++;
 
 	image->descriptor.id = 0;
 	image->descriptor.type = SPICE_IMAGE_TYPE_SURFACE;
@@ -1346,7 +2603,7 @@ qxl_surface_copy (qxl_surface_t *dest,
 	image->descriptor.height = 0;
 	image->surface_image.surface_id = dest->u.copy_src->id;
 
-	drawable = make_drawable (qxl, dest->id, QXL_DRAW_COPY, &qrect);
+	drawable = make_drawable (qxl, dest, QXL_DRAW_COPY, &qrect);
 
 #if 0
 	ErrorF ("Drawing %d to %d [area %d %d %d %d] (command is %p)\n",
@@ -1356,6 +2613,9 @@ qxl_surface_copy (qxl_surface_t *dest,
 #endif
 	
 	drawable->u.copy.src_bitmap = physical_address (qxl, image, qxl->main_mem_slot);
+	src_x1 += dest->u.copy_src->atlas_x;
+	src_y1 += dest->u.copy_src->atlas_y;
+
 	drawable->u.copy.src_area.left = src_x1;
 	drawable->u.copy.src_area.top = src_y1;
 	drawable->u.copy.src_area.right = src_x1 + width;
@@ -1371,7 +2631,7 @@ qxl_surface_copy (qxl_surface_t *dest,
 	drawable->surfaces_rects[0] = drawable->u.copy.src_area;
  	
 #if 0
-	submit_fill (qxl, dest->id, &qrect, 0xffff00ff);
+	submit_fill (qxl, dest, &qrect, 0xffff00ff);
 
 	usleep (70000);
 #endif
@@ -1389,7 +2649,7 @@ qxl_surface_copy (qxl_surface_t *dest,
 	assert (height <= pixman_image_get_height (dest->u.copy_src->host_image));
     }
 
-    push_drawable (qxl, drawable);
+    push_drawable (qxl, dest, drawable);
 }
 
 Bool
@@ -1401,13 +2661,23 @@ qxl_surface_put_image (qxl_surface_t *dest,
     qxl_screen_t *qxl = dest->cache->qxl;
     struct QXLRect rect;
     struct QXLImage *image;
+    int Bpp = dest->bpp == 24 ? 4 : dest->bpp / 8;
+    uint32_t pixel;
     
     rect.left = x;
     rect.right = x + width;
     rect.top = y;
     rect.bottom = y + height;
 
-    drawable = make_drawable (qxl, dest->id, QXL_DRAW_COPY, &rect);
+    invalidate_line_hashes (dest, x, y, x + width, y + height);
+
+    if (is_uniform ((const uint8_t *)src, src_pitch, Bpp, width, height, &pixel))
+    {
+	submit_fill (qxl, dest, &rect, pixel);
+	return TRUE;
+    }
+
+    drawable = make_drawable (qxl, dest, QXL_DRAW_COPY, &rect);
 
     drawable->u.copy.src_area.top = 0;
     drawable->u.copy.src_area.bottom = height;
@@ -1423,11 +2693,11 @@ qxl_surface_put_image (qxl_surface_t *dest,
 
     image = qxl_image_create (
 	qxl, (const uint8_t *)src, 0, 0, width, height, src_pitch,
-	dest->bpp == 24 ? 4 : dest->bpp / 8, FALSE);
+	Bpp, FALSE);
     drawable->u.copy.src_bitmap =
 	physical_address (qxl, image, qxl->main_mem_slot);
     
-    push_drawable (qxl, drawable);
+    push_drawable (qxl, dest, drawable);
 
     return TRUE;
 }
@@ -20,6 +20,11 @@
  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <unistd.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+
 #include <spice.h>
 
 #include "qxl.h"
@@ -129,11 +134,44 @@ static void interface_get_init_info(QXLInstance *sin, QXLDevInitInfo *info)
 
 void qxl_send_events(qxl_screen_t *qxl, int events)
 {
+    uint64_t one = 1;
+
 #if 0
     ErrorF("qxl_send_events %d\n", events);
     qxl_garbage_collect(qxl);
 #endif
     /* we should trigger a garbage collection, but via a pipe. TODO */
+
+    /* Wake up the X server if it is waiting for room in a ring */
+    if (qxl->event_fd >= 0) {
+        if (write(qxl->event_fd, &one, sizeof(one)) != sizeof(one)) {
+            /* the counter is already non-zero, so a wakeup is pending */
+        }
+    }
+}
+
+/* called from Xorg thread context only.
+ * Sleep until the worker thread sends an event or timeout_ms expires. */
+void qxl_wait_for_events(qxl_screen_t *qxl, int timeout_ms)
+{
+    struct pollfd pfd;
+    uint64_t count;
+
+    if (qxl->event_fd < 0) {
+        sched_yield();
+        return;
+    }
+
+    pfd.fd = qxl->event_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    if (poll(&pfd, 1, timeout_ms) > 0 && (pfd.revents & POLLIN)) {
+        /* reset the counter; the caller rechecks its condition */
+        if (read(qxl->event_fd, &count, sizeof(count)) != sizeof(count)) {
+            /* raced with another reader, nothing to reset */
+        }
+    }
 }
 
 /* called from spice server thread context only */
@@ -333,6 +371,10 @@ void qxl_add_spice_display_interface(qxl_screen_t *qxl)
     qxl->cmdflags = 0;
     qxl->oom_running = 0;
     qxl->num_free_res = 0;
+    qxl->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (qxl->event_fd < 0) {
+        ErrorF("eventfd failed, waiting for the worker will poll\n");
+    }
 
     qxl->display_sin.base.sif = &qxl_interface.base;
     qxl->display_sin.id = 0;
@@ -29,5 +29,7 @@
 void qxl_add_spice_display_interface(qxl_screen_t *qxl);
 /* spice-server to device, now spice-server to xspice */
 void qxl_send_events(qxl_screen_t *qxl, int events);
+/* xspice waiting for spice-server to consume commands */
+void qxl_wait_for_events(qxl_screen_t *qxl, int timeout_ms);
 
 #endif // QXL_SPICE_DISPLAY_H